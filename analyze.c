@@ -0,0 +1,416 @@
+#define _GNU_SOURCE // for `reallocarray` extension
+#include "analyze.h"
+#include "common.h"
+#include "instruction.h"
+#include "verify.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int64_t i64;
+
+// past this, the heap hint isn't worth it and the sizes could overflow.
+#define HEAP_OBJECTS_MAX ((i64)1 << 30)
+// instructions run before giving up on a program.
+#define WALK_STEPS_MAX ((usize)1 << 26)
+
+static inline i64 max(i64 a, i64 b) { return a > b ? a : b; }
+
+// where a run through the program is.
+typedef struct {
+  const Program *p;
+  usize pc;
+  Loop *loops;
+  usize loop_depth;
+  usize *rets;
+  usize call_depth;
+  usize steps;
+  bool too_long;
+} Walk;
+
+static Walk walk_start(const Program *p, const VerifyInfo *info) {
+  return (Walk){
+      .p = p,
+      .loops = calloc(info->max_loops + 1, sizeof(Loop)),
+      .rets = calloc(info->max_calls + 1, sizeof(usize)),
+  };
+}
+
+static void walk_end(Walk *w) {
+  free(w->loops);
+  free(w->rets);
+}
+
+// the next instruction that does something to the stack, or NULL when the
+// program ends. Loops and calls are followed here, like the VM does.
+static const Instruction *walk_next(Walk *w) {
+  const Program *p = w->p;
+  while (w->pc < p->len) {
+    if (w->steps++ >= WALK_STEPS_MAX) {
+      w->too_long = true;
+      return NULL;
+    }
+    const Instruction *i = &p->code[w->pc++];
+
+    switch (i->type) {
+    case I_HALT:
+    case I_DIE:
+      w->pc = p->len;
+      return NULL;
+    case I_LOOP:
+      if (i->loop.count <= 0)
+        w->pc = skipLoop(p, w->pc);
+      else
+        w->loops[w->loop_depth++] =
+            (Loop){.index = 0, .count = i->loop.count, .start = w->pc};
+      break;
+    case I_ENDLOOP: {
+      Loop *l = &w->loops[w->loop_depth - 1];
+      if (++l->index < l->count)
+        w->pc = l->start;
+      else
+        w->loop_depth--;
+    } break;
+    case I_PROC:
+      w->pc = p->procs[i->proc.id].end;
+      break;
+    case I_CALL:
+      w->rets[w->call_depth++] = w->pc;
+      w->pc = p->procs[i->proc.id].start;
+      break;
+    case I_RET:
+      w->pc = w->rets[--w->call_depth];
+      break;
+    default:
+      return i;
+    }
+  }
+  return NULL;
+}
+
+// the counter of the loop <depth> levels out from the innermost one.
+static inline i32 walk_index(const Walk *w, i32 depth) {
+  return w->loops[w->loop_depth - 1 - depth].index;
+}
+
+usize heapBound(const Program *p, const VerifyInfo *info) {
+  // objects reachable from each value on the stack, at most. Values that are
+  // shared are counted more than once, which only makes the bound looser.
+  i64 *stack = calloc(info->max_depth + 1, sizeof(*stack));
+  usize sp = 0;
+  i64 live = 0, peak = 0;
+  bool known = true;
+
+  Walk w = walk_start(p, info);
+  for (const Instruction *i; known && (i = walk_next(&w)) != NULL;) {
+    switch (i->type) {
+    case I_READ_LINE:
+      // lines can be as long as they want.
+      known = false;
+      break;
+    case I_READ_CHUNK:
+      stack[sp++] = 2 * (i64)i->chunk.size - 1;
+      live += stack[sp - 1];
+      break;
+    case I_READ_I32:
+    case I_PSH_I32:
+    case I_PSH_STR:
+    case I_LOOP_IDX:
+    case I_VEC_LEN:
+      stack[sp++] = 1;
+      live++;
+      break;
+    case I_POP:
+    case I_FREE:
+      live -= stack[--sp];
+      break;
+    case I_PAIR:
+      sp--;
+      stack[sp - 1] += stack[sp] + 1;
+      live++;
+      break;
+    case I_VEC: {
+      i64 size = 1;
+      for (i32 n = 0; n < i->vec.len; n++)
+        size += stack[--sp];
+      stack[sp++] = size;
+      live++;
+    } break;
+    case I_VEC_GET: {
+      // the item is somewhere inside the vector.
+      i64 item = max(stack[sp - 2] - 1, 1);
+      live += item - stack[sp - 1];
+      stack[sp - 1] = item;
+    } break;
+    case I_HEAD:
+    case I_TAIL: {
+      i64 part = max(stack[sp - 1] - 1, 1);
+      live -= stack[sp - 1] - part;
+      stack[sp - 1] = part;
+    } break;
+    case I_DUP:
+      stack[sp] = stack[sp - 1];
+      live += stack[sp++];
+      break;
+    case I_OVER:
+      stack[sp] = stack[sp - 2];
+      live += stack[sp++];
+      break;
+    case I_SWP: {
+      i64 a = stack[sp - 1];
+      stack[sp - 1] = stack[sp - 2];
+      stack[sp - 2] = a;
+    } break;
+    case I_ROT: {
+      i64 a = stack[sp - 3];
+      stack[sp - 3] = stack[sp - 2];
+      stack[sp - 2] = stack[sp - 1];
+      stack[sp - 1] = a;
+    } break;
+    default:
+      break;
+    }
+    peak = max(peak, live);
+    known &= peak <= HEAP_OBJECTS_MAX;
+  }
+
+  known &= !w.too_long;
+  walk_end(&w);
+  free(stack);
+  return known ? peak : 0;
+}
+
+typedef enum {
+  NODE_LEAF,  // numbers and strings
+  NODE_PAIR,  // children are the head & the tail
+  NODE_VEC,   // children are the items
+  NODE_INPUT, // a list that was read, until a part is taken out of it
+} NodeKind;
+
+// an object of the program, counting who refers to it.
+typedef struct {
+  NodeKind kind;
+  usize refs; // from the stack and from other nodes
+  bool known;
+  i32 value; // if known
+  usize *children;
+  usize len;
+  usize cap;
+} Node;
+
+// the objects of the program. The ids of unreferenced nodes are reused.
+typedef struct {
+  Node *nodes;
+  usize len;
+  usize cap;
+  usize *unused;
+  usize unused_len;
+  // pending nodes for `node_unref` and `node_owned`.
+  usize *work;
+  usize work_cap;
+} Heap;
+
+static usize node_new(Heap *h, NodeKind kind) {
+  usize id;
+  if (h->unused_len > 0) {
+    id = h->unused[--h->unused_len];
+  } else {
+    if (h->len == h->cap) {
+      h->cap = h->cap ? h->cap * 2 : 64;
+      h->nodes = reallocarray(h->nodes, h->cap, sizeof(*h->nodes));
+      h->unused = reallocarray(h->unused, h->cap, sizeof(*h->unused));
+    }
+    id = h->len++;
+    h->nodes[id].children = NULL;
+    h->nodes[id].cap = 0;
+  }
+  Node *n = &h->nodes[id];
+  n->kind = kind;
+  n->refs = 1;
+  n->known = false;
+  n->len = 0;
+  return id;
+}
+
+// make <child> one of the children of <parent>, taking over a reference.
+static void node_adopt(Heap *h, usize parent, usize child) {
+  Node *n = &h->nodes[parent];
+  if (n->len == n->cap) {
+    n->cap = n->cap ? n->cap * 2 : 2;
+    n->children = reallocarray(n->children, n->cap, sizeof(*n->children));
+  }
+  n->children[n->len++] = child;
+}
+
+static void work_push(Heap *h, usize *len, usize id) {
+  if (*len == h->work_cap) {
+    h->work_cap = h->work_cap ? h->work_cap * 2 : 64;
+    h->work = reallocarray(h->work, h->work_cap, sizeof(*h->work));
+  }
+  h->work[(*len)++] = id;
+}
+
+// drop a reference to <id>, and to its children if it was the last one.
+static void node_unref(Heap *h, usize id) {
+  usize len = 0;
+  work_push(h, &len, id);
+  while (len > 0) {
+    Node *n = &h->nodes[h->work[--len]];
+    if (--n->refs > 0)
+      continue;
+    for (usize c = 0; c < n->len; c++)
+      work_push(h, &len, n->children[c]);
+    h->unused[h->unused_len++] = n - h->nodes;
+  }
+}
+
+// whether the only reference to <id>, and to every node under it, is the one
+// that's being dropped. Adds the nodes it looks at to <steps>.
+static bool node_owned(Heap *h, usize id, usize *steps) {
+  usize len = 0;
+  work_push(h, &len, id);
+  while (len > 0) {
+    const Node *n = &h->nodes[h->work[--len]];
+    ++*steps;
+    if (n->refs != 1)
+      return false;
+    for (usize c = 0; c < n->len; c++)
+      work_push(h, &len, n->children[c]);
+  }
+  return true;
+}
+
+typedef enum { POP_UNSEEN, POP_OWNED, POP_SHARED } PopState;
+
+bool findFrees(const Program *p, const VerifyInfo *info, bool *frees) {
+  usize *stack = calloc(info->max_depth + 1, sizeof(*stack));
+  usize sp = 0;
+  PopState *pops = calloc(p->len, sizeof(*pops));
+  Heap h = {0};
+  bool known = true;
+
+  Walk w = walk_start(p, info);
+  for (const Instruction *i; known && (i = walk_next(&w)) != NULL;) {
+    switch (i->type) {
+    case I_PSH_I32:
+    case I_LOOP_IDX: {
+      usize id = node_new(&h, NODE_LEAF);
+      h.nodes[id].known = true;
+      h.nodes[id].value = i->type == I_PSH_I32 ? i->push.value
+                                               : walk_index(&w, i->index.depth);
+      stack[sp++] = id;
+    } break;
+    case I_READ_I32:
+    case I_PSH_STR:
+      stack[sp++] = node_new(&h, NODE_LEAF);
+      break;
+    case I_READ_LINE:
+    case I_READ_CHUNK:
+      stack[sp++] = node_new(&h, NODE_INPUT);
+      break;
+    case I_POP:
+    case I_FREE: {
+      usize id = stack[--sp];
+      PopState *state = &pops[i - p->code];
+      if (*state != POP_SHARED)
+        *state = node_owned(&h, id, &w.steps) ? POP_OWNED : POP_SHARED;
+      node_unref(&h, id);
+    } break;
+    case I_PAIR:
+    case I_VEC: {
+      usize n = i->type == I_PAIR ? 2 : (usize)i->vec.len;
+      usize id = node_new(&h, i->type == I_PAIR ? NODE_PAIR : NODE_VEC);
+      // the references from the stack move into the new node.
+      sp -= n;
+      for (usize c = 0; c < n; c++)
+        node_adopt(&h, id, stack[sp + c]);
+      stack[sp++] = id;
+    } break;
+    case I_VEC_LEN: {
+      const Node *v = &h.nodes[stack[sp - 1]];
+      // the VM would stop here.
+      if (v->kind != NODE_VEC) {
+        known = false;
+        break;
+      }
+      usize id = node_new(&h, NODE_LEAF);
+      h.nodes[id].known = true;
+      h.nodes[id].value = v->len;
+      stack[sp++] = id;
+    } break;
+    case I_VEC_GET: {
+      const Node *index = &h.nodes[stack[sp - 1]];
+      const Node *v = &h.nodes[stack[sp - 2]];
+      // which item is taken out decides what's shared.
+      if (v->kind != NODE_VEC || !index->known || index->value < 0 ||
+          (usize)index->value >= v->len) {
+        known = false;
+        break;
+      }
+      usize item = v->children[index->value];
+      h.nodes[item].refs++;
+      node_unref(&h, stack[sp - 1]);
+      stack[sp - 1] = item;
+    } break;
+    case I_HEAD:
+    case I_TAIL: {
+      usize id = stack[sp - 1];
+      if (h.nodes[id].kind == NODE_INPUT) {
+        // the list is made of pairs like any other, so both parts are made
+        // the first time, and taking one out again shares it.
+        usize head = node_new(&h, NODE_INPUT);
+        usize tail = node_new(&h, NODE_INPUT);
+        node_adopt(&h, id, head);
+        node_adopt(&h, id, tail);
+        h.nodes[id].kind = NODE_PAIR;
+      }
+      const Node *n = &h.nodes[id];
+      if (n->kind != NODE_PAIR) {
+        known = false;
+        break;
+      }
+      usize part = n->children[i->type == I_HEAD ? 0 : 1];
+      h.nodes[part].refs++;
+      node_unref(&h, id);
+      stack[sp - 1] = part;
+    } break;
+    case I_DUP:
+      stack[sp] = stack[sp - 1];
+      h.nodes[stack[sp++]].refs++;
+      break;
+    case I_OVER:
+      stack[sp] = stack[sp - 2];
+      h.nodes[stack[sp++]].refs++;
+      break;
+    case I_SWP: {
+      usize a = stack[sp - 1];
+      stack[sp - 1] = stack[sp - 2];
+      stack[sp - 2] = a;
+    } break;
+    case I_ROT: {
+      usize a = stack[sp - 3];
+      stack[sp - 3] = stack[sp - 2];
+      stack[sp - 2] = stack[sp - 1];
+      stack[sp - 1] = a;
+    } break;
+    default:
+      break;
+    }
+  }
+
+  known &= !w.too_long;
+  if (known) {
+    for (usize pc = 0; pc < p->len; pc++)
+      frees[pc] = pops[pc] == POP_OWNED;
+  }
+
+  walk_end(&w);
+  for (usize id = 0; id < h.len; id++)
+    free(h.nodes[id].children);
+  free(h.nodes);
+  free(h.unused);
+  free(h.work);
+  free(pops);
+  free(stack);
+  return known;
+}
@@ -0,0 +1,23 @@
+#ifndef __ANALYZE_H__
+#define __ANALYZE_H__
+
+#include "common.h"
+#include "instruction.h"
+#include "verify.h"
+#include <stdbool.h>
+
+// These run a verified program the way the VM would but without values, so
+// they only give up on programs that take too long or whose shape depends on
+// the input.
+
+// the most objects that can be alive at once, or 0 if it can't be known (e.g.
+// it reads lines, which can be of any length).
+usize heapBound(const Program *p, const VerifyInfo *info);
+
+// find the `pop`s that always drop the last reference to everything under the
+// value, so it can be freed right away instead of waiting for the GC.
+// <frees> has an entry per instruction. Returns false if it can't be known,
+// and then none of them are set.
+bool findFrees(const Program *p, const VerifyInfo *info, bool *frees);
+
+#endif // !__ANALYZE_H__
@@ -0,0 +1,217 @@
+// aotc: compile a bytecode program to C. Every instruction becomes a call into
+// the VM runtime (vm.c), loops become `for` loops and procedures become
+// functions, so the program runs without decoding or dispatching anything.
+// Link the output with vm.c and gclib to get an executable.
+#define _GNU_SOURCE
+#include "common.h"
+#include "instruction.h"
+#include "vm.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void indent(FILE *out, usize level) {
+  for (usize i = 0; i < level; i++)
+    fputs("  ", out);
+}
+
+// write <len> bytes as a C string literal.
+static void literal(FILE *out, const char *bytes, usize len) {
+  fputc('"', out);
+  for (usize i = 0; i < len; i++) {
+    u8 b = bytes[i];
+    if (b == '"' || b == '\\')
+      fprintf(out, "\\%c", b);
+    else if (b == '\n')
+      fputs("\\n", out);
+    // `?` could start a trigraph.
+    else if (isprint(b) && b != '?')
+      fputc(b, out);
+    else
+      // octal escapes stop after three digits, unlike hex ones.
+      fprintf(out, "\\%03o", b);
+  }
+  fputc('"', out);
+}
+
+// compile from *pc till the end of the block, see `block` in verify.c.
+// <loops> is how many loops of the same function are around it, which are
+// named `i0`, `i1`... from the outermost one.
+static void compile_block(FILE *out, const Program *p, usize *pc, usize loops) {
+  while (*pc < p->len) {
+    const Instruction *i = &p->code[(*pc)++];
+    usize level = loops + 1;
+
+    switch (i->type) {
+    case I_ENDLOOP:
+    case I_RET:
+      return;
+    case I_PROC:
+      // compiled on its own.
+      *pc = p->procs[i->proc.id].end;
+      break;
+    case I_LOOP:
+      indent(out, level);
+      fprintf(out, "for (i32 i%lu = 0; i%lu < %d; i%lu++) {\n", loops, loops,
+              i->loop.count, loops);
+      compile_block(out, p, pc, loops + 1);
+      indent(out, level);
+      fputs("}\n", out);
+      break;
+    case I_LOOP_IDX:
+      indent(out, level);
+      fprintf(out, "pushInt(vm, i%lu);\n", loops - 1 - i->index.depth);
+      break;
+    case I_CALL:
+      indent(out, level);
+      fprintf(out, "proc%d(vm);\n", i->proc.id);
+      break;
+    case I_HALT:
+      indent(out, level);
+      fputs("flushOutput(vm);\n", out);
+      indent(out, level);
+      fputs("exit(0);\n", out);
+      break;
+    case I_DIE:
+      indent(out, level);
+      fputs("die(\"program error: %s\", ", out);
+      literal(out, i->die.errmsg, strlen(i->die.errmsg));
+      fputs(");\n", out);
+      break;
+    case I_HEAP:
+      // reserved by `main`.
+      break;
+    case I_PSH_I32:
+      indent(out, level);
+      fprintf(out, "pushInt(vm, %d);\n", i->push.value);
+      break;
+    case I_PAIR:
+      indent(out, level);
+      fputs("pushPair(vm);\n", out);
+      break;
+    case I_POP:
+      indent(out, level);
+      fputs("pop(vm);\n", out);
+      break;
+    case I_GC:
+      indent(out, level);
+      fputs("gc(vm);\n", out);
+      break;
+    case I_PSH_STR:
+    case I_WRITE:
+      indent(out, level);
+      fprintf(out, "%s(vm, ", i->type == I_WRITE ? "opWrite" : "opPushStr");
+      literal(out, i->str.bytes, i->str.len);
+      fprintf(out, ", %d);\n", i->str.len);
+      break;
+    case I_ASSERT:
+      indent(out, level);
+      fprintf(out, "opAssert(vm, %d, ", i->assert.expected);
+      literal(out, i->assert.msg, strlen(i->assert.msg));
+      fputs(");\n", out);
+      break;
+    case I_READ_CHUNK:
+      indent(out, level);
+      fprintf(out, "opReadChunk(vm, %d);\n", i->chunk.size);
+      break;
+    case I_VEC:
+      indent(out, level);
+      fprintf(out, "opVec(vm, %d);\n", i->vec.len);
+      break;
+    case I_PRINT:
+    case I_READ_I32:
+    case I_READ_LINE:
+    case I_VEC_GET:
+    case I_VEC_LEN:
+    case I_DUP:
+    case I_OVER:
+    case I_SWP:
+    case I_ROT:
+    case I_HEAD:
+    case I_TAIL:
+    case I_FREE: {
+      static const char *ops[] = {
+          [I_PRINT] = "opPrint",     [I_READ_I32] = "opReadI32",
+          [I_READ_LINE] = "opReadLine", [I_VEC_GET] = "opVecGet",
+          [I_VEC_LEN] = "opVecLen",  [I_DUP] = "opDup",
+          [I_OVER] = "opOver",       [I_SWP] = "opSwap",
+          [I_ROT] = "opRot",         [I_HEAD] = "opHead",
+          [I_TAIL] = "opTail",       [I_FREE] = "opFree",
+      };
+      indent(out, level);
+      fprintf(out, "%s(vm);\n", ops[i->type]);
+    } break;
+    }
+  }
+}
+
+static void compile(FILE *out, const Program *p, const char *source) {
+  fprintf(out, "// compiled by aotc from %s.\n", source);
+  fputs("#include \"common.h\"\n"
+        "#include \"vm.h\"\n"
+        "#include <stdlib.h>\n"
+        "#include <string.h>\n\n",
+        out);
+
+  for (usize id = 0; id < p->procs_len; id++) {
+    if (p->procs[id].end != 0)
+      fprintf(out, "static void proc%lu(VM *vm);\n", id);
+  }
+  for (usize id = 0; id < p->procs_len; id++) {
+    if (p->procs[id].end == 0)
+      continue;
+    fprintf(out, "\nstatic void proc%lu(VM *vm) {\n", id);
+    usize pc = p->procs[id].start;
+    compile_block(out, p, &pc, 0);
+    fputs("}\n", out);
+  }
+
+  fputs("\nstatic void program(VM *vm) {\n", out);
+  usize pc = 0;
+  compile_block(out, p, &pc, 0);
+  fputs("}\n", out);
+
+  fputs("\nint main(int argc, const char *argv[]) {\n"
+        "  VM *vm = newVM();\n"
+        "  vm->out.line_buffered = argc > 1 && strcmp(argv[1], \"-l\") == 0;\n"
+        "  setRunningVM(vm);\n",
+        out);
+  if (p->len > 0 && p->code[0].type == I_HEAP)
+    fprintf(out, "  reserveHeap(vm, %d);\n", p->code[0].heap.objects);
+  fputs("\n"
+        "  program(vm);\n"
+        "\n"
+        "  setRunningVM(NULL);\n"
+        "  freeVM(vm);\n"
+        "  return 0;\n"
+        "}\n",
+        out);
+}
+
+int main(int argc, const char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    printf("Usage: %s <bytecode> [<out.c>]\n", *argv);
+    return 1;
+  }
+
+  FILE *in = fopen(argv[1], "rb");
+  if (in == NULL)
+    die("Couldn't open `%s`: %s", argv[1], strerror(errno));
+  Program p = loadProgram(in);
+  fclose(in);
+  // fail now rather than when the compiled program runs.
+  checkProgram(&p);
+
+  FILE *out = argc > 2 ? fopen(argv[2], "w") : stdout;
+  if (out == NULL)
+    die("Couldn't open `%s`: %s", argv[2], strerror(errno));
+  compile(out, &p, argv[1]);
+  if (out != stdout)
+    fclose(out);
+
+  freeProgram(&p);
+  return 0;
+}
@@ -4,14 +4,45 @@
 // 0x02 +4byte int               -> push i32 (constant)
 // 0x03                          -> pop two & push pair
 // 0x04                          -> swap the two
+// 0x08 +4byte int               -> begin a loop that runs <int> times
+// 0x09                          -> end of the loop body
+// 0x0a +4byte int               -> push the counter of an enclosing loop
+// 0x0b +4byte int               -> start of procedure <int>
+// 0x0c                          -> return from procedure
+// 0x0d +4byte int               -> call procedure <int>
+// 0x0e                          -> read a line & push it
+// 0x0f +4byte int               -> read up to <int> bytes & push them
 // 0x10                          -> call GC
+// 0x11 +4byte int +<int> bytes  -> push string
+// 0x13 +4byte int               -> pop <int> values & push them as a vector
+// 0x14                          -> push item of vector
+// 0x15                          -> push length of vector
+// 0x16                          -> dup
+// 0x17                          -> over
+// 0x18                          -> rot
+// 0x19                          -> head of pair
+// 0x1a                          -> tail of pair
+// 0x1b +4byte int               -> most objects alive at once
+// 0x1c                          -> pop & free
+// 0x1d +4byte int +<int> bytes  -> output the bytes
 // 0x12 +4byte int +"string\0"   -> assert the number of allocated objects is
 // <int>, otherwise fail with <string>
 //
 // mnemonics:
 // out :: print current
 // in :: 0x01
+// in_line :: read a line
+// in_chunk <constant> :: read up to <constant> bytes
 // push <constant> :: push i32
+// push_str <string> :: push the string as a single object
+// vec <constant> :: make a vector out of the last <constant> values
+// vec_get :: pop index & push that item of the vector
+// vec_len :: push length of the vector
+// dup :: push the last value again
+// over :: push the value under the last one
+// rot :: move the third value to the top
+// head :: replace pair with its head
+// tail :: replace pair with its tail
 // pair
 // swap
 // gc
@@ -19,11 +50,16 @@
 // print <string> :: print a string of text. with newline.
 // halt :: halt
 // die <string> :: make the program die
+// call <proc> :: call a procedure defined with %proc
 #define _GNU_SOURCE
 #include "common.h"
+#include "emit.h"
 #include "instruction.h"
+#include "analyze.h"
+#include "verify.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -31,6 +67,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void *__attribute_malloc__ __attribute__((nonnull(2)))
 buf_create(usize elem_size, usize *cap) {
@@ -59,6 +98,93 @@ buf_check(void **buf, usize size, usize current_len, usize *cap) {
   for (usize i = 0; i < (other_len); i++)                                      \
   BUF_PUSH(buf, (other_buf)[i], cur_len, cur_cap)
 
+// Everything the source is parsed into (lines, tokens, scopes) is allocated
+// from here and freed at once when the program is written.
+#define ARENA_CHUNK (1 << 20)
+#define ARENA_ALIGN(size)                                                      \
+  (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+typedef struct _chunk {
+  struct _chunk *prev;
+  usize len;
+  usize cap;
+  max_align_t data[];
+} Chunk;
+
+static Chunk *arena = NULL;
+
+void *arena_alloc(usize size) {
+  size = ARENA_ALIGN(size);
+  if (arena == NULL || arena->cap - arena->len < size) {
+    usize cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+    Chunk *c = malloc(sizeof(Chunk) + cap);
+    assert(c != NULL, "out of memory");
+    c->prev = arena;
+    c->len = 0;
+    c->cap = cap;
+    arena = c;
+  }
+  void *p = (char *)arena->data + arena->len;
+  arena->len += size;
+  return p;
+}
+
+// resize <p> from <old> bytes to <new>. It's done in place if it was the last
+// allocation and there's room.
+void *arena_realloc(void *p, usize old, usize new) {
+  old = ARENA_ALIGN(old);
+  new = ARENA_ALIGN(new);
+  if (p != NULL && (char *)p + old == (char *)arena->data + arena->len &&
+      arena->cap - arena->len + old >= new) {
+    arena->len = arena->len - old + new;
+    return p;
+  }
+  void *moved = arena_alloc(new);
+  if (old > 0)
+    memcpy(moved, p, old < new ? old : new);
+  return moved;
+}
+
+// where the arena is, to go back there with `arena_reset`.
+typedef struct {
+  Chunk *chunk;
+  usize len;
+} ArenaMark;
+
+ArenaMark arena_mark(void) {
+  return (ArenaMark){.chunk = arena, .len = arena != NULL ? arena->len : 0};
+}
+
+// free everything allocated after <mark>.
+void arena_reset(ArenaMark mark) {
+  while (arena != mark.chunk) {
+    Chunk *prev = arena->prev;
+    free(arena);
+    arena = prev;
+  }
+  if (arena != NULL)
+    arena->len = mark.len;
+}
+
+void arena_release(void) {
+  while (arena != NULL) {
+    Chunk *prev = arena->prev;
+    free(arena);
+    arena = prev;
+  }
+}
+
+#define ARENA_PUSH(buf, el, cur_len, cap_var)                                  \
+  do {                                                                         \
+    if ((cur_len) == (cap_var)) {                                              \
+      usize old = (cap_var) * sizeof(*(buf));                                  \
+      (cap_var) = (cap_var) ? 2 * (cap_var) : 4;                               \
+      (buf) = arena_realloc((buf), old, (cap_var) * sizeof(*(buf)));          \
+    }                                                                          \
+    (buf)[cur_len] = el;                                                       \
+    (cur_len)++;                                                               \
+  } while (0)
+
 typedef uint32_t u32;
 
 void trim_space(const char **src) {
@@ -87,6 +213,26 @@ typedef enum {
   MNEM_PRINT,
   MNEM_DIE,
   MNEM_HALT,
+  MNEM_CALL,
+  MNEM_IN_LINE,
+  MNEM_IN_CHUNK,
+  MNEM_PUSH_STR,
+  MNEM_VEC,
+  MNEM_VEC_GET,
+  MNEM_VEC_LEN,
+  MNEM_DUP,
+  MNEM_OVER,
+  MNEM_ROT,
+  MNEM_HEAD,
+  MNEM_TAIL,
+  // not written by the user, %repeat and %proc lower to these.
+  MNEM_LOOP,
+  MNEM_ENDLOOP,
+  MNEM_INDEX,
+  MNEM_PROC,
+  MNEM_RET,
+  // the heap hint, added in front of the program.
+  MNEM_HEAP,
   MNEM_UNK,
 } Mnemonic;
 
@@ -101,12 +247,32 @@ typedef struct {
   NType type;
 } Number;
 
-typedef enum { CONST_NUM, CONST_STR, CONST_IDENT } CType;
-typedef enum { DIRECTIVE_REPEAT, DIRECTIVE_END, DIRECTIVE_UNK } Directive;
+// CONST_INDEX is the binding of a %repeat that is emitted as a loop. Its
+// value is the depth of the loop, so it can be turned into an `index`.
+// CONST_PROC is the name of a %proc, its value is the procedure id.
+// CONST_SLOT is the binding of a %repeat that is unrolled. Its value is the
+// slot that has the current iteration when the scope is written, see
+// `lower_scope`.
+typedef enum {
+  CONST_NUM,
+  CONST_STR,
+  CONST_IDENT,
+  CONST_INDEX,
+  CONST_PROC,
+  CONST_SLOT
+} CType;
+typedef enum {
+  DIRECTIVE_REPEAT,
+  DIRECTIVE_PROC,
+  DIRECTIVE_END,
+  DIRECTIVE_UNK
+} Directive;
 
 Directive dir_type(const char *src) {
   if (strcasecmp(src, "repeat") == 0)
     return DIRECTIVE_REPEAT;
+  if (strcasecmp(src, "proc") == 0)
+    return DIRECTIVE_PROC;
   if (strcasecmp(src, "end") == 0)
     return DIRECTIVE_END;
   return DIRECTIVE_UNK;
@@ -122,6 +288,7 @@ typedef struct {
 
 typedef struct {
   TType type;
+  i32 sym; // for identifiers, see `intern`.
   const char *src;
   union {
     Mnemonic mnemonic;
@@ -132,30 +299,125 @@ typedef struct {
   usize line;
 } Token;
 
+// Identifiers are interned into symbols when they're tokenized, so that a
+// binding is found by indexing instead of comparing names through every scope.
+// Each symbol has the binding that is visible now, which hides the ones bound
+// before it till it's unbound.
+typedef struct {
+  Constant constant;
+  i32 hidden; // the binding it hides, or -1.
+} Binding;
+
+static struct {
+  char **names;
+  i32 *visible; // binding of each symbol, or -1.
+  usize len;
+  // open addressing, symbol + 1 or 0 for an empty slot. At most half full.
+  i32 *table;
+  usize table_cap;
+  Binding *bindings;
+  usize bindings_len;
+  usize bindings_cap;
+} symbols;
+
+static u32 hash_name(const char *name) {
+  // FNV-1a
+  u32 h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (u8)*name) * 16777619u;
+  return h;
+}
+
+static void grow_symbols(void) {
+  usize cap = symbols.table_cap ? 2 * symbols.table_cap : 64;
+  i32 *table = calloc(cap, sizeof(*table));
+  for (usize sym = 0; sym < symbols.len; sym++) {
+    usize i = hash_name(symbols.names[sym]) & (cap - 1);
+    while (table[i])
+      i = (i + 1) & (cap - 1);
+    table[i] = sym + 1;
+  }
+  free(symbols.table);
+  symbols.table = table;
+  symbols.table_cap = cap;
+  symbols.names = reallocarray(symbols.names, cap / 2, sizeof(*symbols.names));
+  symbols.visible = reallocarray(symbols.visible, cap / 2, sizeof(i32));
+  if (symbols.bindings == NULL)
+    symbols.bindings = buf_create(sizeof(Binding), &symbols.bindings_cap);
+}
+
+// the symbol for <name>, the same for every identifier spelled like it.
+i32 intern(const char *name) {
+  if (2 * (symbols.len + 1) > symbols.table_cap)
+    grow_symbols();
+  usize mask = symbols.table_cap - 1;
+  for (usize i = hash_name(name) & mask;; i = (i + 1) & mask) {
+    i32 sym = symbols.table[i] - 1;
+    if (sym < 0) {
+      sym = symbols.len++;
+      symbols.names[sym] = strdup(name);
+      symbols.visible[sym] = -1;
+      symbols.table[i] = sym + 1;
+      return sym;
+    }
+    if (strcmp(symbols.names[sym], name) == 0)
+      return sym;
+  }
+}
+
+// make <sym> refer to <c> till it's unbound.
+void bind(i32 sym, Constant c) {
+  Binding b = {.constant = c, .hidden = symbols.visible[sym]};
+  symbols.visible[sym] = symbols.bindings_len;
+  BUF_PUSH(symbols.bindings, b, symbols.bindings_len, symbols.bindings_cap);
+}
+
+// undo the last `bind`, which must have been of <sym>.
+void unbind(i32 sym) {
+  symbols.visible[sym] = symbols.bindings[--symbols.bindings_len].hidden;
+}
+
+bool lookup(i32 sym, Constant *dest) {
+  i32 b = symbols.visible[sym];
+  if (b < 0)
+    return false;
+  *dest = symbols.bindings[b].constant;
+  return true;
+}
+
+void release_symbols(void) {
+  for (usize sym = 0; sym < symbols.len; sym++)
+    free(symbols.names[sym]);
+  free(symbols.names);
+  free(symbols.visible);
+  free(symbols.table);
+  free(symbols.bindings);
+}
+
 Mnemonic mnem_type(const char *msg) {
-  if (strcasecmp(msg, "out") == 0)
-    return MNEM_OUT;
-  if (strcasecmp(msg, "in") == 0)
-    return MNEM_IN;
-  if (strcasecmp(msg, "halt") == 0)
-    return MNEM_HALT;
-  if (strcasecmp(msg, "die") == 0)
-    return MNEM_DIE;
-  if (strcasecmp(msg, "push") == 0)
-    return MNEM_PUSH;
-  if (strcasecmp(msg, "pair") == 0)
-    return MNEM_PAIR;
-  if (strcasecmp(msg, "swap") == 0)
-    return MNEM_SWP;
-  if (strcasecmp(msg, "assert_allocated") == 0) {
-    return MNEM_ASSERT;
+  static const struct {
+    const char *name;
+    Mnemonic mnemonic;
+  } names[] = {
+      {"out", MNEM_OUT}, {"in", MNEM_IN},
+      {"halt", MNEM_HALT}, {"die", MNEM_DIE},
+      {"push", MNEM_PUSH}, {"pair", MNEM_PAIR},
+      {"swap", MNEM_SWP}, {"assert_allocated", MNEM_ASSERT},
+      {"gc", MNEM_GC}, {"print", MNEM_PRINT},
+      {"pop", MNEM_POP}, {"call", MNEM_CALL},
+      {"in_line", MNEM_IN_LINE}, {"in_chunk", MNEM_IN_CHUNK},
+      {"push_str", MNEM_PUSH_STR}, {"vec", MNEM_VEC},
+      {"vec_get", MNEM_VEC_GET}, {"vec_len", MNEM_VEC_LEN},
+      {"dup", MNEM_DUP}, {"over", MNEM_OVER},
+      {"rot", MNEM_ROT}, {"head", MNEM_HEAD},
+      {"tail", MNEM_TAIL},
+  };
+  // most tokens are told apart by their first letter, without a call.
+  char first = tolower(*msg);
+  for (usize i = 0; i < sizeof(names) / sizeof(*names); i++) {
+    if (names[i].name[0] == first && strcasecmp(msg, names[i].name) == 0)
+      return names[i].mnemonic;
   }
-  if (strcasecmp(msg, "gc") == 0)
-    return MNEM_GC;
-  if (strcasecmp(msg, "print") == 0)
-    return MNEM_PRINT;
-  if (strcasecmp(msg, "pop") == 0)
-    return MNEM_POP;
   return MNEM_UNK;
 }
 
@@ -195,6 +457,7 @@ NType num_type(const char *src) {
 void identify(Token *tok) {
 
   tok->type = TOK_UNK;
+  tok->sym = -1;
 
   if (tok->src == NULL) {
     tok->type = TOK_EOL;
@@ -244,6 +507,7 @@ void identify(Token *tok) {
     }
     if (id_fine) {
       tok->type = TOK_IDENT;
+      tok->sym = intern(tok->src);
       return;
     }
   }
@@ -259,14 +523,18 @@ char *lex_space(char **line_) {
     line++;
     for (; *line && *line != '"'; ++line)
       ;
-    line++;
+    if (*line)
+      line++;
     // otherwise skip till space.
   } else {
     for (; *line && !isspace(*line); ++line)
       ;
   }
-  *line = 0;
-  line++;
+  // don't go past the end of the line if the token was the last one.
+  if (*line) {
+    *line = 0;
+    line++;
+  }
   // skip space after the token
   for (; *line && isspace(*line); ++line)
     ;
@@ -346,13 +614,25 @@ typedef struct {
   Mnemonic opcode; // 0xfa is used to tell the assembler to generate print code.
   const char *str; // for instructions with strings.
   i32 num;         // for instructions with numbers
+  i32 slot;        // if not -1, <num> is the iteration in this slot.
 } Op;
 
 static const u8 opcodes[] = {
-    [MNEM_OUT] = I_PRINT,     [MNEM_IN] = I_READ_I32, [MNEM_PUSH] = I_PSH_I32,
-    [MNEM_PAIR] = I_PAIR,     [MNEM_SWP] = I_SWP,     [MNEM_GC] = I_GC,
-    [MNEM_ASSERT] = I_ASSERT, [MNEM_PRINT] = 0xfa,    [MNEM_POP] = I_POP,
-    [MNEM_HALT] = I_HALT,     [MNEM_DIE] = I_DIE,
+    [MNEM_OUT] = I_PRINT,       [MNEM_IN] = I_READ_I32,
+    [MNEM_PUSH] = I_PSH_I32,    [MNEM_PAIR] = I_PAIR,
+    [MNEM_SWP] = I_SWP,         [MNEM_GC] = I_GC,
+    [MNEM_ASSERT] = I_ASSERT,   [MNEM_PRINT] = 0xfa,
+    [MNEM_POP] = I_POP,         [MNEM_HALT] = I_HALT,
+    [MNEM_DIE] = I_DIE,         [MNEM_CALL] = I_CALL,
+    [MNEM_LOOP] = I_LOOP,       [MNEM_ENDLOOP] = I_ENDLOOP,
+    [MNEM_INDEX] = I_LOOP_IDX,  [MNEM_PROC] = I_PROC,
+    [MNEM_RET] = I_RET,         [MNEM_IN_LINE] = I_READ_LINE,
+    [MNEM_IN_CHUNK] = I_READ_CHUNK, [MNEM_PUSH_STR] = I_PSH_STR,
+    [MNEM_VEC] = I_VEC,         [MNEM_VEC_GET] = I_VEC_GET,
+    [MNEM_VEC_LEN] = I_VEC_LEN, [MNEM_DUP] = I_DUP,
+    [MNEM_OVER] = I_OVER,       [MNEM_ROT] = I_ROT,
+    [MNEM_HEAD] = I_HEAD,       [MNEM_TAIL] = I_TAIL,
+    [MNEM_HEAP] = I_HEAP,
 };
 
 const char *mnemonic_name(Mnemonic mnem) {
@@ -370,41 +650,84 @@ void assert_eof(char **line, Token *current, const char *msg) {
   assert(current->type == TOK_EOL, "%s", msg);
 }
 
-static void opcode(FILE *fp, Mnemonic opcode) {
-  fwrite(&opcodes[opcode], 1, 1, fp);
+static void opcode(Emitter *e, Mnemonic opcode) {
+  emitByte(e, opcodes[opcode]);
 }
-static void out_val(FILE *fp, i32 value) { fwrite(&value, 4, 1, fp); }
-static void out_str(FILE *fp, const char *str) {
+static void out_val(Emitter *e, i32 value) { emitI32(e, value); }
+static void out_str(Emitter *e, const char *str) {
   *strchrnul(str, '"') = 0;
-  fputs(str, fp);
-  fputc(0, fp);
+  emitStr(e, str);
 }
 
-static void push(FILE *fp, i32 value) {
+static void push(Emitter *fp, i32 value) {
   opcode(fp, MNEM_PUSH);
-  fwrite(&value, 4, 1, fp);
+  out_val(fp, value);
 }
 
-static void pop(FILE *fp) { opcode(fp, MNEM_POP); }
-static void pout(FILE *fp) { opcode(fp, MNEM_OUT); }
-static void in(FILE *fp) { opcode(fp, MNEM_IN); }
-static void pair(FILE *fp) { opcode(fp, MNEM_PAIR); }
-static void swp(FILE *fp) { opcode(fp, MNEM_SWP); }
+// strings end at their closing quote, see `identify`.
+static void push_str(Emitter *fp, const char *str, bool newline) {
+  *strchrnul(str, '"') = 0;
+  i32 len = strlen(str);
+  opcode(fp, MNEM_PUSH_STR);
+  out_val(fp, len + newline);
+  emitBytes(fp, str, len);
+  if (newline)
+    emitByte(fp, '\n');
+}
+
+static void pop(Emitter *fp) { opcode(fp, MNEM_POP); }
+static void vec(Emitter *fp, i32 len) {
+  opcode(fp, MNEM_VEC);
+  out_val(fp, len);
+}
+static void vec_get(Emitter *fp) { opcode(fp, MNEM_VEC_GET); }
+static void vec_len(Emitter *fp) { opcode(fp, MNEM_VEC_LEN); }
+static void pout(Emitter *fp) { opcode(fp, MNEM_OUT); }
+static void in(Emitter *fp) { opcode(fp, MNEM_IN); }
+static void in_line(Emitter *fp) { opcode(fp, MNEM_IN_LINE); }
+static void in_chunk(Emitter *fp, i32 size) {
+  opcode(fp, MNEM_IN_CHUNK);
+  out_val(fp, size);
+}
+static void pair(Emitter *fp) { opcode(fp, MNEM_PAIR); }
+static void swp(Emitter *fp) { opcode(fp, MNEM_SWP); }
 
-static void out_assert(FILE *fp, i32 val, const char *str) {
+static void out_assert(Emitter *fp, i32 val, const char *str) {
   opcode(fp, MNEM_ASSERT);
   out_val(fp, val);
   out_str(fp, str);
 }
 
-static void gc(FILE *fp) { opcode(fp, MNEM_GC); }
-static void halt(FILE *fp) { opcode(fp, MNEM_HALT); }
-static void out_die(FILE *fp, const char *errmsg) {
+static void gc(Emitter *fp) { opcode(fp, MNEM_GC); }
+static void loop(Emitter *fp, i32 count) {
+  opcode(fp, MNEM_LOOP);
+  out_val(fp, count);
+}
+static void endloop(Emitter *fp) { opcode(fp, MNEM_ENDLOOP); }
+static void loop_index(Emitter *fp, i32 depth) {
+  opcode(fp, MNEM_INDEX);
+  out_val(fp, depth);
+}
+static void proc(Emitter *fp, i32 id) {
+  opcode(fp, MNEM_PROC);
+  out_val(fp, id);
+}
+static void ret(Emitter *fp) { opcode(fp, MNEM_RET); }
+static void call(Emitter *fp, i32 id) {
+  opcode(fp, MNEM_CALL);
+  out_val(fp, id);
+}
+static void heap(Emitter *fp, i32 objects) {
+  opcode(fp, MNEM_HEAP);
+  out_val(fp, objects);
+}
+static void halt(Emitter *fp) { opcode(fp, MNEM_HALT); }
+static void out_die(Emitter *fp, const char *errmsg) {
   opcode(fp, MNEM_DIE);
   out_str(fp, errmsg);
 }
 
-void process_op(FILE *out, const Op *op) {
+void process_op(Emitter *out, const Op *op) {
   switch (op->opcode) {
   case MNEM_HALT:
     halt(out);
@@ -413,26 +736,31 @@ void process_op(FILE *out, const Op *op) {
     out_die(out, op->str);
     break;
   case MNEM_PRINT:
-    // loop the string in reverse
-    {
-
-      // make sure the pairs are aligned.
-      push(out, op->str[0]);
-      push(out, op->str[1]);
-      pair(out);
-      *strchrnul(op->str, '"') = 0;
-      for (const char *start = &op->str[2]; *start; start++) {
-        push(out, *start);
-        pair(out);
-      }
-      push(out, '\n');
-      pair(out);
-
-      pout(out);
-      pop(out);
-      // force a deallocation.
-      gc(out);
-    }
+    push_str(out, op->str, true);
+    pout(out);
+    pop(out);
+    // force a deallocation.
+    gc(out);
+    break;
+  case MNEM_PUSH_STR:
+    push_str(out, op->str, false);
+    break;
+  case MNEM_VEC:
+    assert(op->num >= 0, "vec: length must not be negative, got %d", op->num);
+    vec(out, op->num);
+    break;
+  case MNEM_VEC_GET:
+    vec_get(out);
+    break;
+  case MNEM_VEC_LEN:
+    vec_len(out);
+    break;
+  case MNEM_DUP:
+  case MNEM_OVER:
+  case MNEM_ROT:
+  case MNEM_HEAD:
+  case MNEM_TAIL:
+    opcode(out, op->opcode);
     break;
   case MNEM_OUT:
     pout(out);
@@ -446,6 +774,13 @@ void process_op(FILE *out, const Op *op) {
   case MNEM_IN:
     in(out);
     break;
+  case MNEM_IN_LINE:
+    in_line(out);
+    break;
+  case MNEM_IN_CHUNK:
+    assert(op->num > 0, "in_chunk: size must be positive, got %d", op->num);
+    in_chunk(out, op->num);
+    break;
   case MNEM_PAIR:
     pair(out);
     break;
@@ -460,39 +795,41 @@ void process_op(FILE *out, const Op *op) {
   case MNEM_GC:
     gc(out);
     break;
-  }
-
-  if (errno) {
-    perror("fwrite");
-    exit(1);
+  case MNEM_LOOP:
+    loop(out, op->num);
+    break;
+  case MNEM_ENDLOOP:
+    endloop(out);
+    break;
+  case MNEM_INDEX:
+    loop_index(out, op->num);
+    break;
+  case MNEM_PROC:
+    proc(out, op->num);
+    break;
+  case MNEM_RET:
+    ret(out);
+    break;
+  case MNEM_CALL:
+    call(out, op->num);
+    break;
+  case MNEM_HEAP:
+    heap(out, op->num);
+    break;
   }
 }
 
-typedef enum { SCOPE_NORMAL, SCOPE_REPEAT } SType;
+typedef enum { SCOPE_NORMAL, SCOPE_REPEAT, SCOPE_PROC } SType;
 
+// the tokens point into the source, see `read_source`.
 typedef struct {
   Token *tokens;
   usize tokens_len;
-  usize tokens_size;
-  const char *original_line;
   usize line_no;
-  bool is_original;
 } TokLine;
 
 void print_tokline(const TokLine *line);
 
-void release_parsed_line(TokLine *l) {
-  if (!l->is_original)
-    return;
-  free((void *)l->original_line);
-  free(l->tokens);
-}
-
-typedef struct {
-  const char *name;
-  Constant constant;
-} Binding;
-
 typedef enum { OUT_SCOPE, OUT_SINGLE } OType;
 
 struct __scope;
@@ -508,24 +845,47 @@ typedef struct {
 typedef struct __scope {
   SType scope_type;
   usize decl_line;
-  Output **out;
+  Output *out;
   usize scope_len;
   usize scope_size;
   struct __scope *next;
 
-  Binding *constants;
-  usize consts_len;
-  usize consts_cap;
+  // the outputs with their arguments resolved, see `lower_scope`.
+  struct _lowered *lowered;
+
+  // native %repeats around it and itself, set by `lower_scope`.
+  usize loops;
+  // %procs in it, only the root scope has them.
+  i32 procs;
 
   union {
     struct {
       usize n;
-      // The variable for the loop. If ommitted, it's _.
-      const char *var_name;
+      // The variable for the loop. If ommitted, it's -1.
+      i32 var;
+      // whether it's emitted as a `loop` instead of being unrolled.
+      bool native;
+      // where the iteration goes when unrolled.
+      i32 slot;
     } repeat;
+    struct {
+      const char *name;
+      i32 sym;
+      i32 id;
+    } proc;
   };
 } Scope;
 
+// an output of a scope after `lower_scope`: an instruction that only needs to
+// be encoded, or an inner scope.
+typedef struct _lowered {
+  OType type;
+  union {
+    Op op;
+    Scope *inner_scope;
+  };
+} Lowered;
+
 typedef enum {
   // directives like %repeat need a scope
   IM_BEGIN_SCOPE,
@@ -547,29 +907,14 @@ typedef struct {
   };
 } IMCode;
 
-Output *out_line(TokLine *line) {
-  Output *out = malloc(sizeof(Output));
-  out->type = OUT_SINGLE;
-  out->line = line;
-  return out;
-}
-
-Output *out_scope(Scope *s) {
-  Output *out = malloc(sizeof(Output));
-  out->type = OUT_SCOPE;
-  out->inner_scope = s;
-  return out;
-}
-
-TokLine *tokenize_line(const char *line_, usize line_no) {
-  TokLine *l = malloc(sizeof(TokLine));
-  l->is_original = true;
-  char *line = strdup(line_);
+// <line> is lexed in place.
+TokLine *tokenize_line(char *line, usize line_no) {
+  TokLine *l = arena_alloc(sizeof(TokLine));
   l->line_no = line_no;
-  l->original_line = line;
+  l->tokens = NULL;
   l->tokens_len = 0;
-  l->tokens_size = 4;
-  l->tokens = calloc(4, sizeof(*l->tokens));
+  // nothing else is allocated till the line ends, so they grow in place.
+  usize cap = 0;
 
   Token current;
   current.col = 0;
@@ -581,137 +926,67 @@ TokLine *tokenize_line(const char *line_, usize line_no) {
     identify(&current);
     assert(current.type != TOK_UNK, "Unknown token: `%s` at %lu:%lu",
            current.src, current.line, current.col);
-    BUF_PUSH(l->tokens, current, l->tokens_len, l->tokens_size);
+    ARENA_PUSH(l->tokens, current, l->tokens_len, cap);
     current.col += lexed;
   } while (current.type != TOK_EOL);
+  // give back what wasn't used.
+  l->tokens = arena_realloc(l->tokens, cap * sizeof(*l->tokens),
+                            l->tokens_len * sizeof(*l->tokens));
 
   return l;
 }
 
-void __attribute__((nonnull)) push_out(Scope *current, Output *out) {
-  if (current->scope_len == current->scope_size) {
-    current->scope_size *= 2;
-    current->out = reallocarray(current->out, current->scope_size, sizeof(out));
-  }
-  current->out[current->scope_len] = out;
-  (current->scope_len)++;
-  //  BUF_PUSH(current->lines, line, current->scope_len, current->scope_size);
+void __attribute__((nonnull)) push_out(Scope *current, Output out) {
+  ARENA_PUSH(current->out, out, current->scope_len, current->scope_size);
 }
 
 void __attribute__((nonnull)) push_line(Scope *current, TokLine *line) {
-  push_out(current, out_line(line));
+  push_out(current, (Output){.type = OUT_SINGLE, .line = line});
 }
 
 void __attribute__((nonnull)) push_scope(Scope *current, Scope *sc) {
-  push_out(current, out_scope(sc));
+  push_out(current, (Output){.type = OUT_SCOPE, .inner_scope = sc});
 }
 
 // returns a normal scope.
 Scope *__attribute_const__ new_scope() {
-  Scope *s = malloc(sizeof(Scope));
+  Scope *s = arena_alloc(sizeof(Scope));
   s->decl_line = 0;
   s->scope_type = SCOPE_NORMAL;
   s->scope_len = 0;
-  s->scope_size = 4;
-  s->out = calloc(4, sizeof(Output *));
-  s->consts_len = 0;
-  s->consts_cap = 4;
-  s->constants = calloc(4, sizeof(Binding));
+  s->scope_size = 0;
+  s->out = NULL;
+  s->lowered = NULL;
+  s->loops = 0;
+  s->procs = 0;
   s->next = NULL;
   return s;
 }
 
-// Find variable in **single** scope.
-bool __attribute__((nonnull(2, 3))) __attribute_const__
-scope_find(const Scope *s, const char *name, Constant *dest) {
-  if (s == NULL)
-    return false;
-  for (usize i = 0; i < s->consts_len; i++) {
-    if (strcmp(name, s->constants[i].name) == 0) {
-      *dest = s->constants[i].constant;
-      return true;
-    }
-  }
-  return false;
-}
-
-// Find variable using the scope chain
-bool __attribute__((nonnull(2, 3))) __attribute_const__
-find_constant(const Scope *s, const char *name, Constant *dest) {
-  if (s == NULL)
-    return false;
-  do {
-    if (scope_find(s, name, dest))
-      return true;
-    s = s->next;
-  } while (s != NULL);
-  return false;
-}
-
-bool resolve_const(const Scope *s, const char *name, Constant *dest) {
-  if (!find_constant(s, name, dest))
-    return false;
-  if (dest->c_type == CONST_IDENT)
-    return resolve_const(s, dest->str, dest);
-  return true;
-}
-
-void __attribute__((nonnull(1, 2)))
-set_constant(Scope *s, const char *name, Constant value) {
-  // replace the constant if it's there.
-  for (usize i = 0; i < s->consts_len; i++) {
-    Binding *c = &s->constants[i];
-    if (strcmp(name, c->name) == 0) {
-      c->constant = value;
-      return;
-    }
-  }
-  // else, push a new one.
-  Binding c = (Binding){.name = name, .constant = value};
-  BUF_PUSH(s->constants, c, s->consts_len, s->consts_cap);
-}
-
-void release_scope(Scope *s);
-
-void release_output(Output *out) {
-  switch (out->type) {
-  case OUT_SCOPE:
-    release_scope(out->inner_scope);
-    free(out->inner_scope);
-    break;
-  case OUT_SINGLE:
-    release_parsed_line(out->line);
-    free(out->line);
-    break;
-  }
-}
-
-void __attribute__((nonnull)) release_scope(Scope *s) {
-  for (usize i = 0; i < s->scope_len; i++) {
-    release_output(s->out[i]);
-    free(s->out[i]);
-  }
-  // free scope lines and tokens
-  free(s->out);
-  free(s->constants);
-
-  if (s->scope_type == SCOPE_REPEAT) {
-    free((void *)s->repeat.var_name);
-  }
-}
-
-Scope *__attribute__((nonnull(2))) __attribute_const__
-repeat_scope(usize n, const char *var_name) {
+Scope *__attribute_const__ repeat_scope(usize n, i32 var) {
   Scope *s = new_scope();
   s->scope_type = SCOPE_REPEAT;
   s->repeat.n = n;
-  s->repeat.var_name = var_name;
+  s->repeat.var = var;
+  s->repeat.native = false;
+  s->repeat.slot = -1;
+  return s;
+}
+
+// the id is given when the procedure is registered in the root scope.
+Scope *__attribute__((nonnull)) proc_scope(const char *name, i32 sym) {
+  Scope *s = new_scope();
+  s->scope_type = SCOPE_PROC;
+  s->proc.name = name;
+  s->proc.sym = sym;
+  s->proc.id = -1;
   return s;
 }
 
 Op __attribute_const__ new_op(Mnemonic opcode) {
   Op op;
   op.opcode = opcode;
+  op.slot = -1;
   return op;
 }
 
@@ -728,7 +1003,7 @@ Token *__attribute__((nonnull)) please_tok(const TokLine *line, usize *index) {
   return &line->tokens[(*index)++];
 }
 
-Token *__attribute__((nonnull(1, 2))) __attribute_const__
+Token *__attribute__((nonnull(1, 2)))
 expect_tok(const TokLine *line, usize *index, TType expected_type) {
   Token *tok = please_tok(line, index);
   assert(tok->type == expected_type,
@@ -752,6 +1027,9 @@ typedef struct {
 static const char *ctant_names[] = {
     [CONST_NUM] = "number",
     [CONST_STR] = "string",
+    [CONST_INDEX] = "loop index",
+    [CONST_PROC] = "procedure",
+    [CONST_SLOT] = "number",
 };
 
 typedef struct {
@@ -764,7 +1042,7 @@ typedef struct {
 
 // resolves the constant to a non intermediate state,
 // that is either string or numeric value.
-void __attribute__((nonnull)) _resolve_constant(Token *tok, const Scope *s) {
+void __attribute__((nonnull)) _resolve_constant(Token *tok) {
   Constant *ctant = &tok->constant;
   if (ctant->c_type == CONST_NUM) {
     // the number needs to be parsed.
@@ -773,17 +1051,16 @@ void __attribute__((nonnull)) _resolve_constant(Token *tok, const Scope *s) {
   }
   if (ctant->c_type == CONST_IDENT) {
     // find the binding
-    assert(resolve_const(s, tok->src, ctant),
+    assert(lookup(tok->sym, ctant),
            "Couldn't find constant `%s` from %lu:%lu in the current scope",
            tok->src, tok->line, tok->col);
   }
   // if it's a string, it's already resolved.
 }
 
-Constant __attribute__((nonnull))
-resolve_constant(const Token *tok, const Scope *s) {
+Constant __attribute__((nonnull)) resolve_constant(const Token *tok) {
   Token replacable = *tok;
-  _resolve_constant(&replacable, s);
+  _resolve_constant(&replacable);
   assert(replacable.constant.c_type != CONST_IDENT,
          "Identifier should have be gone or errored out");
   return replacable.constant;
@@ -809,13 +1086,15 @@ expect_constant(const TokLine *line, usize *index) {
   return tok;
 }
 
-Constant __attribute__((nonnull(1, 2, 4)))
-expect_constant_kind(const TokLine *line, usize *index, CType type,
-                     const Scope *s) {
+Constant __attribute__((nonnull))
+expect_constant_kind(const TokLine *line, usize *index, CType type) {
 
   Token *tok = expect_constant(line, index);
-  Constant ctant = resolve_constant(tok, s);
-  assert(ctant.c_type == type, "Expected %s, got %s at %lu:%lu: `%s`",
+  Constant ctant = resolve_constant(tok);
+  // a loop index is a number, only known at runtime.
+  bool number = ctant.c_type == CONST_INDEX || ctant.c_type == CONST_SLOT;
+  assert(ctant.c_type == type || (number && type == CONST_NUM),
+         "Expected %s, got %s at %lu:%lu: `%s`",
          ctant_names[type], ctant_names[ctant.c_type], tok->line, tok->col,
          tok->src);
   return ctant;
@@ -848,7 +1127,7 @@ void __attribute__((nonnull(1, 2, 3, 4)))
 opcode_insert(Op *op, const TokLine *line, usize *index, const Scope *s,
               CType ctype) {
 
-  Constant ctant = expect_constant_kind(line, index, ctype, s);
+  Constant ctant = expect_constant_kind(line, index, ctype);
 
 
   switch (ctant.c_type) {
@@ -861,6 +1140,18 @@ opcode_insert(Op *op, const TokLine *line, usize *index, const Scope *s,
   case CONST_STR:
     op->str = ctant.str;
     break;
+  case CONST_INDEX:
+    // only `push` is allowed to use it, see `binding_only_pushed`.
+    assert(op->opcode == MNEM_PUSH, "loop index used outside of push");
+    op->opcode = MNEM_INDEX;
+    op->num = s->loops - ctant.num.value;
+    break;
+  case CONST_PROC:
+    op->num = ctant.num.value;
+    break;
+  case CONST_SLOT:
+    op->slot = ctant.num.value;
+    break;
   }
 }
 
@@ -883,14 +1174,29 @@ const OpSpec specs[] = {
     [MNEM_PUSH] =
         (OpSpec){.opcode = MNEM_PUSH, .args_len = 1, .args = {CONST_NUM}},
     [MNEM_POP] = (OpSpec){.opcode = MNEM_POP, .args_len = 0},
-    [MNEM_SWP] = (OpSpec){.opcode = MNEM_SWP, .args_len = 0}};
+    [MNEM_SWP] = (OpSpec){.opcode = MNEM_SWP, .args_len = 0},
+    [MNEM_CALL] =
+        (OpSpec){.opcode = MNEM_CALL, .args_len = 1, .args = {CONST_PROC}},
+    [MNEM_IN_LINE] = (OpSpec){.opcode = MNEM_IN_LINE, .args_len = 0},
+    [MNEM_PUSH_STR] =
+        (OpSpec){.opcode = MNEM_PUSH_STR, .args_len = 1, .args = {CONST_STR}},
+    [MNEM_VEC] =
+        (OpSpec){.opcode = MNEM_VEC, .args_len = 1, .args = {CONST_NUM}},
+    [MNEM_VEC_GET] = (OpSpec){.opcode = MNEM_VEC_GET, .args_len = 0},
+    [MNEM_VEC_LEN] = (OpSpec){.opcode = MNEM_VEC_LEN, .args_len = 0},
+    [MNEM_DUP] = (OpSpec){.opcode = MNEM_DUP, .args_len = 0},
+    [MNEM_OVER] = (OpSpec){.opcode = MNEM_OVER, .args_len = 0},
+    [MNEM_ROT] = (OpSpec){.opcode = MNEM_ROT, .args_len = 0},
+    [MNEM_HEAD] = (OpSpec){.opcode = MNEM_HEAD, .args_len = 0},
+    [MNEM_TAIL] = (OpSpec){.opcode = MNEM_TAIL, .args_len = 0},
+    [MNEM_IN_CHUNK] =
+        (OpSpec){.opcode = MNEM_IN_CHUNK, .args_len = 1, .args = {CONST_NUM}}};
 
 Op __attribute_const__ __attribute__((nonnull))
 parse(const TokLine *line, const Scope *scope) {
   usize i = 0;
-  Op op;
   Token *fst = expect_tok(line, &i, TOK_MNEM);
-  op.opcode = fst->mnemonic;
+  Op op = new_op(fst->mnemonic);
 
   const OpSpec *spec = &specs[op.opcode];
 
@@ -914,38 +1220,40 @@ parse(const TokLine *line, const Scope *scope) {
 
 void print_tok(const Token *tok);
 
-TokLine *advance(const TokLine *original, usize n) {
-  TokLine *l = malloc(sizeof(TokLine));
-  *l = *original;
-  assert(l->tokens_len > n, "Tried to advance line more than expected");
-  l->is_original = false;
-  l->tokens += n;
-  l->tokens_len -= n;
-  return l;
-}
-
-i32 __attribute__((nonnull(1, 3)))
-expect_number(const TokLine *args, usize index, const Scope *s) {
-  return expect_constant_kind(args, &index, CONST_NUM, s).num.value;
+i32 __attribute__((nonnull)) expect_number(const TokLine *args, usize index) {
+  return expect_constant_kind(args, &index, CONST_NUM).num.value;
 }
 
-const char *__attribute__((nonnull(1, 3)))
-expect_str(const TokLine *args, usize index, const Scope *s) {
-  return expect_constant_kind(args, &index, CONST_NUM, s).str;
+const char *__attribute__((nonnull))
+expect_str(const TokLine *args, usize index) {
+  return expect_constant_kind(args, &index, CONST_NUM).str;
 }
 
 void __attribute__((nonnull(1, 2)))
 parse_repeat(IMCode *code, const TokLine *args, const Scope *s) {
+  (void)s;
   usize i = 1;
-  i32 n = expect_number(args, i, s);
+  i32 n = expect_number(args, i);
   assert(n >= 0, "Attempt to repeat a negative amount: %d", n);
   i = 2;
-  const char *str = args->tokens_len > 3
-                        ? strdup(expect_tok(args, &i, TOK_IDENT)->src)
-                        : NULL;
+  i32 var = args->tokens_len > 3 ? expect_tok(args, &i, TOK_IDENT)->sym : -1;
+  (void)expect_tok(args, &i, TOK_EOL);
+  code->type = IM_BEGIN_SCOPE;
+  code->new_scope = repeat_scope(n, var);
+  code->new_scope->decl_line = args->line_no;
+}
+
+void __attribute__((nonnull(1, 2)))
+parse_proc(IMCode *code, const TokLine *args, const Scope *s) {
+  // procedures can't see any %repeat binding, they're compiled once.
+  assert(s->next == NULL, "%%proc at line %lu must be at the top level",
+         args->line_no);
+  usize i = 1;
+  const Token *name = expect_tok(args, &i, TOK_IDENT);
+  Scope *proc = proc_scope(name->src, name->sym);
   (void)expect_tok(args, &i, TOK_EOL);
   code->type = IM_BEGIN_SCOPE;
-  code->new_scope = repeat_scope(n, str);
+  code->new_scope = proc;
   code->new_scope->decl_line = args->line_no;
 }
 
@@ -959,6 +1267,7 @@ parse_end(IMCode *code, const TokLine *args, const Scope *s) {
 static void (*directive_parsers[])(IMCode *code, const TokLine *args,
                                    const Scope *s) = {
     [DIRECTIVE_REPEAT] = parse_repeat,
+    [DIRECTIVE_PROC] = parse_proc,
     [DIRECTIVE_END] = parse_end,
 };
 
@@ -978,8 +1287,6 @@ IMCode get_code(TokLine *line, const Scope *s) {
   switch (first->type) {
   case TOK_DIRECTIVE:
     parse_directive(&code, line, first->directive, s);
-    release_parsed_line(line);
-    free(line);
     break;
   case TOK_MNEM:
     code.type = IM_INSTR;
@@ -993,22 +1300,206 @@ IMCode get_code(TokLine *line, const Scope *s) {
   return code;
 }
 
-static void __attribute__((nonnull)) flatten_scope(Scope *s, FILE *out);
+// turn the `pop`s of values that nothing else refers to into `free`s.
+static void free_hints(Program *p, const VerifyInfo *info) {
+  bool *frees = calloc(p->len, sizeof(*frees));
+  if (findFrees(p, info, frees)) {
+    for (usize pc = 0; pc < p->len; pc++) {
+      if (frees[pc] && p->code[pc].type == I_POP)
+        p->code[pc].type = I_FREE;
+    }
+  }
+  free(frees);
+}
 
-static void __attribute__((nonnull))
-flatten_output(const Output *out, FILE *outf, Scope *s) {
-  switch (out->type) {
-  case OUT_SCOPE:
-    out->inner_scope->next = s;
-    flatten_scope(out->inner_scope, outf);
-    out->inner_scope->next = NULL;
+// what `-O` changed, for `-v`.
+typedef struct {
+  usize push_pops; // values pushed only to be popped
+  usize swaps;     // `swap`s undone by the next one
+  usize writes;    // constants pushed only to be written out
+  usize merged;    // writes joined with the one before
+  usize gcs;       // collections with nothing new to collect
+} OptStats;
+
+// instructions that only push a value, which is fine to not push at all.
+static bool only_pushes(IType type) {
+  return type == I_PSH_I32 || type == I_PSH_STR || type == I_LOOP_IDX ||
+         type == I_DUP || type == I_OVER;
+}
+
+// whether nothing was allocated or dropped between the last `gc` (or the start
+// of the program) and the end of <code>.
+static bool nothing_to_collect(const Instruction *code, usize len) {
+  for (usize pc = len; pc > 0; pc--) {
+    switch (code[pc - 1].type) {
+    case I_GC:
+      return true;
+    case I_PRINT:
+    case I_WRITE:
+    case I_SWP:
+    case I_ROT:
+    case I_DUP:
+    case I_OVER:
+    case I_ASSERT:
+    case I_HEAP:
+      continue;
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+// peephole pass over the whole program. Instructions are only removed or
+// merged inside a block, never across loops or procedures, so jumps keep
+// working once the procedures are resolved again.
+static void optimize(Program *p, OptStats *stats) {
+  Instruction *code = p->code;
+  usize len = 0;
+  // the last instruction was a `print` folded into a `write`.
+  bool print_tail = false;
+  // `assert_allocated` also counts the objects that were dropped but not
+  // collected yet, so pushes that allocate stay, and `print` also collects
+  // whatever was dropped before it.
+  bool counts_objects = false;
+  for (usize pc = 0; pc < p->len; pc++)
+    counts_objects |= p->code[pc].type == I_ASSERT;
+
+  for (usize pc = 0; pc < p->len; pc++) {
+    Instruction *i = &p->code[pc];
+    Instruction *last = len > 0 ? &code[len - 1] : NULL;
+    bool after_print = print_tail;
+    print_tail = false;
+
+    if (i->type == I_POP && last != NULL && only_pushes(last->type) &&
+        (!counts_objects || last->type == I_DUP || last->type == I_OVER)) {
+      releaseInstruction(last);
+      len--;
+      stats->push_pops++;
+      continue;
+    }
+    if (i->type == I_SWP && last != NULL && last->type == I_SWP) {
+      len--;
+      stats->swaps++;
+      continue;
+    }
+
+    // push <constant>; out; pop
+    Instruction *value = len > 1 ? &code[len - 2] : NULL;
+    if (i->type == I_POP && !counts_objects && value != NULL &&
+        last->type == I_PRINT &&
+        (value->type == I_PSH_STR || value->type == I_PSH_I32)) {
+      if (value->type == I_PSH_I32) {
+        char *byte = malloc(1);
+        *byte = value->push.value;
+        value->str.bytes = byte;
+        value->str.len = 1;
+      }
+      value->type = I_WRITE;
+      len--;
+      stats->writes++;
+
+      Instruction *prev = len > 1 ? &code[len - 2] : NULL;
+      if (prev != NULL && prev->type == I_WRITE) {
+        char *bytes = realloc((char *)prev->str.bytes,
+                              prev->str.len + value->str.len);
+        memcpy(&bytes[prev->str.len], value->str.bytes, value->str.len);
+        prev->str.bytes = bytes;
+        prev->str.len += value->str.len;
+        releaseInstruction(value);
+        len--;
+        stats->merged++;
+      }
+      print_tail = true;
+      continue;
+    }
+
+    // `print` collects to free its string, which isn't allocated anymore.
+    if (i->type == I_GC && ((after_print && !counts_objects) ||
+                            nothing_to_collect(code, len))) {
+      stats->gcs++;
+      continue;
+    }
+
+    code[len++] = *i;
+  }
+
+  p->len = len;
+  resolveProcs(p);
+}
+
+static usize program_size(const Program *p) {
+  usize size = 0;
+  for (usize pc = 0; pc < p->len; pc++)
+    size += instructionSize(&p->code[pc]);
+  return size;
+}
+
+static void report(usize len, usize size, const Program *p,
+                   const OptStats *stats) {
+  fprintf(stderr, "-O: %lu -> %lu instructions, %lu -> %lu bytes\n", len,
+          p->len, size, program_size(p));
+  fprintf(stderr, "  %lu push/pop pairs removed\n", stats->push_pops);
+  fprintf(stderr, "  %lu swap/swap pairs removed\n", stats->swaps);
+  fprintf(stderr, "  %lu constant outputs folded into write\n", stats->writes);
+  fprintf(stderr, "  %lu writes merged\n", stats->merged);
+  fprintf(stderr, "  %lu gc removed\n", stats->gcs);
+}
+
+typedef struct {
+  bool frees;    // -f
+  bool optimize; // -O
+  bool verbose;  // -v
+  bool stream;   // -s
+} Options;
+
+// put the `heap` hint in front of the program.
+static void prepend_heap(Program *p, usize objects) {
+  p->code = reallocarray(p->code, p->len + 1, sizeof(*p->code));
+  memmove(&p->code[1], p->code, p->len * sizeof(*p->code));
+  p->code[0] = (Instruction){.type = I_HEAP, .heap.objects = objects};
+  p->len++;
+  resolveProcs(p);
+}
+
+// write the assembled <code> to <out> in a container, with a `heap` hint in
+// front when the most objects it can have alive are known, so the VM can
+// reserve them.
+static void write_program(int out, Emitter *code, const Options *opts) {
+  if (code->len == 0)
     return;
-  case OUT_SINGLE: {
-    Op op = parse(out->line, s);
-    process_op(outf, &op);
+
+  Program p = loadProgramMemory(code->bytes, code->len);
+
+  VerifyInfo info;
+  // invalid programs are left for the VM to report, as they are.
+  if (!verifyProgram(&p, &info)) {
+    freeProgram(&p);
+    assert(flushEmitter(code, out), "write: %s", strerror(errno));
     return;
   }
+
+  if (opts->optimize) {
+    usize before = p.len;
+    OptStats stats = {0};
+    optimize(&p, &stats);
+    if (opts->verbose)
+      report(before, code->len, &p, &stats);
+    assert(verifyProgram(&p, &info), "-O broke the program at %lu: %s",
+           info.error_pc, info.error);
   }
+
+  usize max_depth = info.max_depth;
+  usize objects = heapBound(&p, &info);
+  if (opts->frees)
+    free_hints(&p, &info);
+  if (objects > 0)
+    prepend_heap(&p, objects);
+  // the code is put in a container, in what's already been allocated for it.
+  code->len = 0;
+  emitProgram(code, &p, max_depth);
+  freeProgram(&p);
+  assert(flushEmitter(code, out), "write: %s", strerror(errno));
 }
 
 // TODO: macro name tokens
@@ -1016,11 +1507,103 @@ flatten_output(const Output *out, FILE *outf, Scope *s) {
 // parsing macros
 // complete parse routine.
 
+// whether the token refers to the binding <sym>.
+static bool is_binding(const Token *tok, i32 sym) {
+  bool ident = tok->type == TOK_IDENT ||
+               (tok->type == TOK_CTANT && tok->constant.c_type == CONST_IDENT);
+  return ident && tok->sym == sym;
+}
+
+// Check that the binding <sym> is only used as `push <sym>` inside <s>,
+// since that's the only place where the VM can give the loop counter.
+static bool binding_only_pushed(const Scope *s, i32 sym) {
+  for (usize i = 0; i < s->scope_len; i++) {
+    const Output *out = &s->out[i];
+    if (out->type == OUT_SCOPE) {
+      const Scope *inner = out->inner_scope;
+      // shadowed.
+      if (inner->scope_type == SCOPE_REPEAT && inner->repeat.var == sym)
+        continue;
+      if (!binding_only_pushed(inner, sym))
+        return false;
+      continue;
+    }
+    const TokLine *line = out->line;
+    for (usize j = 1; j < line->tokens_len; j++) {
+      if (is_binding(&line->tokens[j], sym) &&
+          !(j == 1 && line->tokens[0].mnemonic == MNEM_PUSH))
+        return false;
+    }
+  }
+  return true;
+}
+
+// Lower every output of <s> once: parse its lines, resolving their arguments
+// with the bindings of the scopes around them, and lower its inner scopes.
+// The bindings of
+// unrolled %repeats become slots, so the lowered scope can be written for
+// every iteration without parsing anything again. <slots> is the number of
+// slots taken by the scopes around <s>. Returns how many are needed in total.
+static usize lower_scope(Scope *s, usize slots) {
+  s->loops = s->next != NULL ? s->next->loops : 0;
+  i32 var = s->scope_type == SCOPE_REPEAT ? s->repeat.var : -1;
+  if (s->scope_type == SCOPE_REPEAT) {
+    Constant c;
+    // not worth a loop for a single iteration.
+    if (s->repeat.n > 1 && (var < 0 || binding_only_pushed(s, var))) {
+      // emitted as a loop in the VM. The binding (if any) becomes the loop
+      // counter.
+      s->repeat.native = true;
+      c.c_type = CONST_INDEX;
+      c.num.value = ++s->loops;
+    } else {
+      s->repeat.slot = slots++;
+      c.c_type = CONST_SLOT;
+      c.num.value = s->repeat.slot;
+    }
+    if (var >= 0)
+      bind(var, c);
+  }
+
+  usize needed = slots;
+  s->lowered = arena_alloc(s->scope_len * sizeof(*s->lowered));
+  for (usize i = 0; i < s->scope_len; i++) {
+    const Output *out = &s->out[i];
+    Lowered l = {.type = out->type};
+    if (out->type == OUT_SCOPE) {
+      l.inner_scope = out->inner_scope;
+      l.inner_scope->next = s;
+      usize inner = lower_scope(l.inner_scope, slots);
+      l.inner_scope->next = NULL;
+      if (inner > needed)
+        needed = inner;
+    } else {
+      l.op = parse(out->line, s);
+    }
+    s->lowered[i] = l;
+  }
+  if (var >= 0)
+    unbind(var);
+  return needed;
+}
+
+static void __attribute__((nonnull)) flatten_scope(const Scope *s, i32 *slots,
+                                                   Emitter *out);
+
 // Flatten a normal scope. Plain old simple.
 // Just put the instructions one by one.
-static void flatten_normal_scope(Scope *s, FILE *outf) {
+static void flatten_normal_scope(const Scope *s, i32 *slots, Emitter *outf) {
   for (usize i = 0; i < s->scope_len; i++) {
-    flatten_output(s->out[i], outf, s);
+    const Lowered *l = &s->lowered[i];
+    if (l->type == OUT_SCOPE) {
+      flatten_scope(l->inner_scope, slots, outf);
+    } else if (l->op.slot < 0) {
+      process_op(outf, &l->op);
+    } else {
+      Op op = l->op;
+      op.num = slots[op.slot];
+      process_op(outf, &op);
+    }
   }
 }
 
@@ -1028,38 +1611,43 @@ static void flatten_normal_scope(Scope *s, FILE *outf) {
 // gives access to a constant for the block that will change on each iteration.
 // the language cannot jump, it is not turing complete. So this is the only way
 // you can do loops without hurting your hand  badly.
-// interior mutability: will mutate internally, but that doesn't raise any
-// problem. The variables inside the scopes will be **overriden** on each call,
-// no assumption is made about them.
-static void flatten_repeat_scope(Scope *s, FILE *outf) {
-
-  Constant c;
-  c.c_type = CONST_NUM;
-
-  for (c.num.value = 0; c.num.value < s->repeat.n; c.num.value++) {
-
-    // the scope IS mutated from the inside.
-    // there is no change that the values will be read badly as every time
-    // this function is called the loop overrides the variable.
-    if (s->repeat.var_name)
-      set_constant((Scope *)s, s->repeat.var_name, c);
+// Unless it's a loop in the VM, the iteration is put in its slot so the
+// instructions that use the binding see it.
+static void flatten_repeat_scope(const Scope *s, i32 *slots, Emitter *outf) {
+  if (s->repeat.native) {
+    loop(outf, (i32)s->repeat.n);
+    flatten_normal_scope(s, slots, outf);
+    endloop(outf);
+    return;
+  }
 
-    flatten_normal_scope(s, outf);
+  for (i32 i = 0; (usize)i < s->repeat.n; i++) {
+    slots[s->repeat.slot] = i;
+    flatten_normal_scope(s, slots, outf);
   }
 }
 
-static void (*scope_flatteners[])(Scope *s, FILE *) = {
+// Flatten a %proc. The body is written once where it's defined, the VM
+// skips over it and only runs it on `call`.
+static void flatten_proc_scope(const Scope *s, i32 *slots, Emitter *outf) {
+  proc(outf, s->proc.id);
+  flatten_normal_scope(s, slots, outf);
+  ret(outf);
+}
+
+static void (*scope_flatteners[])(const Scope *s, i32 *slots, Emitter *) = {
     [SCOPE_NORMAL] = flatten_normal_scope,
-    [SCOPE_REPEAT] = flatten_repeat_scope};
+    [SCOPE_REPEAT] = flatten_repeat_scope,
+    [SCOPE_PROC] = flatten_proc_scope};
 
-static void flatten_scope(Scope *s, FILE *out) {
-  return scope_flatteners[s->scope_type](s, out);
+static void flatten_scope(const Scope *s, i32 *slots, Emitter *out) {
+  return scope_flatteners[s->scope_type](s, slots, out);
 }
 
 char *__attribute_const__ trim_line(char *line) {
   char *end = strchrnul(line, ';');
   // trim right
-  for (; *(end - 1) && isspace(*(end - 1)); --end)
+  for (; end > line && isspace(*(end - 1)); --end)
     ;
   // trim left.
   for (; *line && isspace(*line); ++line)
@@ -1071,8 +1659,52 @@ char *__attribute_const__ trim_line(char *line) {
 
 IMCode type_only(IMType type) { return (IMCode){.line = NULL, .type = type}; }
 
-void __attribute__((nonnull))
-follow_imcode(IMCode *code, Scope **scope, FILE *out) {
+// make the procedure callable by name from anywhere in the program. Ids are
+// given in order of definition.
+// The root scope is never unbound, and nothing else is bound till the whole
+// program is read.
+void __attribute__((nonnull)) register_proc(Scope *root, Scope *proc) {
+  Constant c;
+  assert(!lookup(proc->proc.sym, &c),
+         "Procedure `%s` at line %lu is already defined", proc->proc.name,
+         proc->decl_line);
+  proc->proc.id = root->procs++;
+
+  c.c_type = CONST_PROC;
+  c.num.value = proc->proc.id;
+  bind(proc->proc.sym, c);
+}
+
+// where code goes as soon as it's complete with `-s`.
+typedef struct {
+  Emitter code;
+  int out;
+  // what the root scope was parsed into is freed back to here once written.
+  ArenaMark mark;
+} Stream;
+
+// how much code is held back with `-s` before it's written.
+#define STREAM_FLUSH (1 << 16)
+
+// write what's in the root scope and forget it. Procedures stay bound, so
+// they can be called from what comes after.
+static void stream_root(Scope *root, Stream *stream) {
+  i32 *slots = calloc(lower_scope(root, 0) + 1, sizeof(*slots));
+  flatten_scope(root, slots, &stream->code);
+  free(slots);
+  if (stream->code.len >= STREAM_FLUSH)
+    assert(flushEmitter(&stream->code, stream->out), "write: %s",
+           strerror(errno));
+  root->out = NULL;
+  root->scope_len = 0;
+  root->scope_size = 0;
+  arena_reset(stream->mark);
+}
+
+// <stream> is NULL unless streaming, then the root scope is written every
+// time an instruction or a scope is added to it.
+void __attribute__((nonnull(1, 2)))
+follow_imcode(IMCode *code, Scope **scope, Stream *stream) {
 
   switch (code->type) {
   case IM_DIRECTIVE:
@@ -1086,6 +1718,8 @@ follow_imcode(IMCode *code, Scope **scope, FILE *out) {
     push_line(*scope, code->line);
     break;
   case IM_BEGIN_SCOPE: {
+    if (code->new_scope->scope_type == SCOPE_PROC)
+      register_proc(*scope, code->new_scope);
     code->new_scope->next = *scope;
     *scope = code->new_scope;
   } break;
@@ -1101,6 +1735,19 @@ follow_imcode(IMCode *code, Scope **scope, FILE *out) {
     *scope = last;
     break;
   }
+
+  if (stream != NULL && (*scope)->next == NULL && (*scope)->scope_len > 0)
+    stream_root(*scope, stream);
+}
+
+static void assemble_line(char *line, usize line_no, Scope **current,
+                          Stream *stream) {
+  char *trimmed = trim_line(line);
+  if (!*trimmed)
+    return;
+  TokLine *tok_line = tokenize_line(trimmed, line_no);
+  IMCode code = get_code(tok_line, *current);
+  follow_imcode(&code, current, stream);
 }
 
 void print_ctant(const Token *tok) {
@@ -1148,12 +1795,78 @@ void print_tokline(const TokLine *line) {
   putchar('\n');
 }
 
+typedef struct {
+  char *bytes;
+  usize len;
+  bool mapped;
+} Source;
+
+// The source is mapped privately so that it can be lexed in place: lines and
+// tokens get a NUL after them where they are, and everything parsed from them
+// points there. Anything that can't be mapped (like a pipe) is read instead.
+static Source read_source(FILE *fp) {
+  Source src = {0};
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    src.bytes = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fileno(fp), 0);
+    if (src.bytes != MAP_FAILED) {
+      src.len = st.st_size;
+      src.mapped = true;
+      return src;
+    }
+  }
+
+  usize cap = BUFSIZ;
+  src.bytes = malloc(cap);
+  usize n;
+  while ((n = fread(src.bytes + src.len, 1, cap - src.len, fp)) > 0) {
+    src.len += n;
+    if (src.len == cap)
+      src.bytes = realloc(src.bytes, cap *= 2);
+  }
+  assert(!ferror(fp), "read: %s", strerror(errno));
+  return src;
+}
+
+static void release_source(Source *src) {
+  if (src->mapped)
+    munmap(src->bytes, src->len);
+  else
+    free(src->bytes);
+}
+
 // quick assembler line by line. doesn't support anything more than mnemonics,
 // basic constants (hex and dec), basic strings (no escape support) and their
 // arguments separated.
 int main(int argc, const char *argv[]) {
-  if (argc != 2 && argc != 3) {
-    printf("Usage: %s <file> [<out>]\n", *argv);
+  const char *usage =
+      "Usage: %s [-f] [-O [-v]] <file> [<out>]\n"
+      "       %s -s <file> [<out>]\n"
+      "  -f  free values right away when the program is done with them\n"
+      "  -O  optimize the program\n"
+      "  -v  report what -O changed\n"
+      "  -s  write top-level code as soon as it's read\n";
+  const char *name = *argv;
+  Options opts = {0};
+  for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+    if (strcmp(argv[1], "-f") == 0) {
+      opts.frees = true;
+    } else if (strcmp(argv[1], "-O") == 0) {
+      opts.optimize = true;
+    } else if (strcmp(argv[1], "-v") == 0) {
+      opts.verbose = true;
+    } else if (strcmp(argv[1], "-s") == 0) {
+      opts.stream = true;
+    } else {
+      printf(usage, name, name);
+      return 1;
+    }
+  }
+  // the others need the whole program.
+  bool whole = opts.frees || opts.optimize || opts.verbose;
+  if ((argc != 2 && argc != 3) || (opts.stream && whole)) {
+    printf(usage, name, name);
     return 1;
   }
 
@@ -1162,50 +1875,87 @@ int main(int argc, const char *argv[]) {
     perror("fopen");
     return 1;
   }
+  usize line_no = 0;
 
-  FILE *out = fopen(argc > 2 ? argv[2] : "a.out", "wb");
-  if (out == NULL) {
-    perror("fopen");
+  int out = open(argc > 2 ? argv[2] : "a.out", O_WRONLY | O_CREAT | O_TRUNC,
+                 0666);
+  if (out < 0) {
+    perror("open");
     return 1;
   }
 
-  setvbuf(out, NULL, _IONBF, 0);
-
   Scope *current = new_scope();
   Scope *first = current;
 
-  char *line = 0;
-  usize line_sz = 0;
-  usize line_no = 1;
-  i32 line_len = 0;
-
-  for (; (line_len = getline(&line, &line_sz, fp)) > 0; line_no++) {
-    char *trimmed = trim_line(line);
-    if (!*trimmed)
-      continue;
-    TokLine *tok_line = tokenize_line(trimmed, line_no);
-    IMCode code = get_code(tok_line, current);
-    follow_imcode(&code, &current, out);
+  if (opts.stream) {
+    // the source isn't mapped, it's only read a line at a time and copied
+    // into the arena till its scope is written.
+    Stream stream = {.out = out, .mark = arena_mark()};
+    char *line = NULL;
+    usize line_sz = 0;
+    ssize_t line_len;
+    while ((line_len = getline(&line, &line_sz, fp)) > 0) {
+      if (line[line_len - 1] == '\n')
+        line[--line_len] = 0;
+      char *copy = arena_alloc(line_len + 1);
+      memcpy(copy, line, line_len + 1);
+      assemble_line(copy, ++line_no, &current, &stream);
+    }
+    assert(!ferror(fp), "getline: %s", strerror(errno));
+    free(line);
+    fclose(fp);
+
+    assert(current == first,
+           "Please consider giving scope at line %lu an end marker with "
+           "`%%end`",
+           current->decl_line);
+    assert(flushEmitter(&stream.code, out), "write: %s", strerror(errno));
+    freeEmitter(&stream.code);
+    release_symbols();
+    arena_release();
+    close(out);
+    return 0;
   }
 
-  if (line_len == -1 && errno != 0) {
-    perror("getline");
-    return 1;
+  // the code is kept in memory till the hint is known.
+  Emitter code = {0};
+
+  Source src = read_source(fp);
+  fclose(fp);
+
+  char *end = src.bytes + src.len;
+  char *next;
+  for (char *line = src.bytes; line < end; line = next) {
+    char *nl = memchr(line, '\n', end - line);
+    if (nl != NULL) {
+      *nl = 0;
+      next = nl + 1;
+    } else {
+      // the last line has no newline to put the NUL in.
+      char *copy = arena_alloc(end - line + 1);
+      memcpy(copy, line, end - line);
+      copy[end - line] = 0;
+      line = copy;
+      next = end;
+    }
+    assemble_line(line, ++line_no, &current, NULL);
   }
 
   assert(current == first,
          "Please consider giving scope at line %lu an end marker with `%%end`",
          current->decl_line);
 
-  flatten_scope(current, out);
-  release_scope(current);
-  free(current);
+  i32 *slots = calloc(lower_scope(current, 0) + 1, sizeof(*slots));
+  flatten_scope(current, slots, &code);
+  free(slots);
+  release_symbols();
+  arena_release();
+  release_source(&src);
 
-  if (line)
-    free(line);
+  write_program(out, &code, &opts);
+  freeEmitter(&code);
 
-  fclose(fp);
-  fclose(out);
+  close(out);
 
   return 0;
 }
@@ -6,7 +6,17 @@
 #include <string.h>
 #include <unistd.h>
 
+static void (*die_hook)(void) = NULL;
+
+void atdie(void (*hook)(void)) { die_hook = hook; }
+
 static void __attribute__((noreturn)) vdie(const char *fmt, va_list va) {
+  if (die_hook != NULL) {
+    // don't run it again if it dies itself.
+    void (*hook)(void) = die_hook;
+    die_hook = NULL;
+    hook();
+  }
   if (isatty(stdout->_fileno)) {
     fputs("\x1b[1m\x1b[38;5;1merror: \x1b[m", stderr);
   } else {
@@ -11,5 +11,7 @@ typedef int32_t i32;
 void __attribute__((format(printf, 2, 3))) assert(int e, const char *msg, ...);
 void die(const char *fmt, ...) __attribute__((format(printf, 1, 2)))
 __attribute__((noreturn));
+// run <hook> before printing the error when dying, e.g to flush output.
+void atdie(void (*hook)(void));
 
 #endif // !__COMMON_H__
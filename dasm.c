@@ -1,31 +1,74 @@
 // dissasembler
+#define _GNU_SOURCE
+#include "analyze.h"
 #include "common.h"
 #include "instruction.h"
+#include "verify.h"
 #include <ctype.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #define FORCE_INLINE __attribute__((always_inline))
 
+// colours are only for terminals, files and pipes get plain text.
+static bool colour;
+#define COLOUR(code) (colour ? "\x1b[38;5;" code "m" : "")
+#define RESET (colour ? "\x1b[m" : "")
+
+// printf takes longer to parse its format than to print these.
+static void FORCE_INLINE print_int(i32 value) {
+  char buf[12];
+  char *p = buf + sizeof(buf);
+  // negative, so INT32_MIN fits.
+  i32 n = value < 0 ? value : -value;
+  do {
+    *--p = '0' - n % 10;
+    n /= 10;
+  } while (n != 0);
+  if (value < 0)
+    *--p = '-';
+  fwrite(p, 1, buf + sizeof(buf) - p, stdout);
+}
+
 static void FORCE_INLINE iname(const char *msg) {
-  printf("\x1b[38;5;4m%s\x1b[m", msg);
+  fputs(COLOUR("4"), stdout);
+  fputs(msg, stdout);
+  fputs(RESET, stdout);
 }
 
 static void FORCE_INLINE inum(i32 value) {
-  printf("\x1b[38;5;5m%d\x1b[m", value);
+  fputs(COLOUR("5"), stdout);
+  print_int(value);
+  fputs(RESET, stdout);
 }
 
 static void FORCE_INLINE escape(char v) {
-  printf("\x1b[38;5;5m'\x1b[38;5;3m\\%c\x1b[38;5;5m'\x1b[m", v);
+  fputs(COLOUR("5"), stdout);
+  putchar('\'');
+  fputs(COLOUR("3"), stdout);
+  putchar('\\');
+  putchar(v);
+  fputs(COLOUR("5"), stdout);
+  putchar('\'');
+  fputs(RESET, stdout);
+}
+static void FORCE_INLINE ch(char v) {
+  fputs(COLOUR("5"), stdout);
+  putchar('\'');
+  putchar(v);
+  putchar('\'');
+  fputs(RESET, stdout);
 }
-static void FORCE_INLINE ch(char v) { printf("\x1b[38;5;5m'%c'\x1b[m", v); }
 
 static void FORCE_INLINE i_possible_char(i32 value) {
 
   switch (value) {
   default:
-    if (isprint(value))
+    // isprint only takes bytes.
+    if (value >= 0 && value <= 0x7f && isprint(value))
       ch(value);
     else
       inum(value);
@@ -36,10 +79,39 @@ static void FORCE_INLINE i_possible_char(i32 value) {
 }
 
 static void FORCE_INLINE istr(const char *v) {
-  printf("\x1b[38;5;2m\"%s\"\x1b[m", v);
+  fputs(COLOUR("2"), stdout);
+  putchar('"');
+  fputs(v, stdout);
+  putchar('"');
+  fputs(RESET, stdout);
+}
+
+// strings with a length may have anything in them.
+static void FORCE_INLINE istrn(const char *v, usize len) {
+  static const char hex[] = "0123456789abcdef";
+  fputs(COLOUR("2"), stdout);
+  putchar('"');
+  // print the runs that need no escaping at once.
+  usize plain = 0;
+  for (usize i = 0; i < len; i++) {
+    u8 b = v[i];
+    if (b != '\n' && b <= 0x7f && isprint(b))
+      continue;
+    fwrite(&v[plain], 1, i - plain, stdout);
+    plain = i + 1;
+    if (b == '\n') {
+      fputs("\\n", stdout);
+    } else {
+      char x[4] = {'\\', 'x', hex[b >> 4], hex[b & 0xf]};
+      fwrite(x, 1, sizeof(x), stdout);
+    }
+  }
+  fwrite(&v[plain], 1, len - plain, stdout);
+  putchar('"');
+  fputs(RESET, stdout);
 }
 
-void printInstruction(const Instruction *i) {
+static void printInstruction(const Instruction *i) {
   iname(inames[i->type]);
   if (i->type == I_ASSERT) {
     putchar(' ');
@@ -52,26 +124,124 @@ void printInstruction(const Instruction *i) {
   } else if (i->type == I_DIE) {
     putchar(' ');
     istr(i->die.errmsg);
+  } else if (i->type == I_LOOP) {
+    putchar(' ');
+    inum(i->loop.count);
+  } else if (i->type == I_LOOP_IDX) {
+    putchar(' ');
+    inum(i->index.depth);
+  } else if (i->type == I_PROC || i->type == I_CALL) {
+    putchar(' ');
+    inum(i->proc.id);
+  } else if (i->type == I_READ_CHUNK) {
+    putchar(' ');
+    inum(i->chunk.size);
+  } else if (i->type == I_VEC) {
+    putchar(' ');
+    inum(i->vec.len);
+  } else if (i->type == I_HEAP) {
+    putchar(' ');
+    inum(i->heap.objects);
+  } else if (i->type == I_PSH_STR || i->type == I_WRITE) {
+    putchar(' ');
+    istrn(i->str.bytes, i->str.len);
   }
   putchar('\n');
 }
 
+static void printHeader(const BytecodeHeader *h) {
+  printf("; version %u, %u instructions, %u bytes of code, %u bytes of "
+         "strings",
+         h->version, h->instructions, h->code_size, h->strings_size);
+  if (h->max_depth > 0)
+    printf(", at most %u values on the stack", h->max_depth);
+  putchar('\n');
+}
+
+// what's in the program, rather than the program.
+static void printStats(Decoder *d) {
+  Program p = decodeProgram(d);
+
+  usize count[I_WRITE + 1] = {0};
+  usize strings = 0; // inline `die` and `assert` messages
+  for (usize pc = 0; pc < p.len; pc++) {
+    const Instruction *i = &p.code[pc];
+    count[i->type]++;
+    if (i->type == I_DIE)
+      strings += strlen(i->die.errmsg) + 1;
+    else if (i->type == I_ASSERT)
+      strings += strlen(i->assert.msg) + 1;
+  }
+
+  printf("%lu instructions\n", p.len);
+  if (d->container)
+    printf("%u bytes of strings in the pool\n", d->header.strings_size);
+  else
+    printf("%lu bytes of strings in the code\n", strings);
+
+  VerifyInfo info;
+  if (verifyProgram(&p, &info)) {
+    printf("at most %lu values on the stack\n", info.max_depth);
+    usize objects = heapBound(&p, &info);
+    if (objects > 0)
+      printf("at most %lu objects alive\n", objects);
+    else
+      printf("the objects alive can't be known\n");
+  } else {
+    printf("invalid at instruction %lu: %s\n", info.error_pc, info.error);
+  }
+
+  printInstructionCounts(count);
+  freeProgram(&p);
+}
+
 int main(int argc, const char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <file>\n", *argv);
+  bool stats = false;
+  const char *fname = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else if (fname == NULL && argv[i][0] != '-') {
+      fname = argv[i];
+    } else {
+      fname = NULL;
+      break;
+    }
+  }
+  if (fname == NULL) {
+    fprintf(stderr, "Usage: %s [--stats] <file>\n", *argv);
+    fprintf(stderr, "  --stats  only print what the program has in it\n");
     return 1;
   }
 
-  FILE *in = fopen(argv[1], "rb");
+  FILE *in = fopen(fname, "rb");
   if (in == NULL) {
-    die("Couldn't open `%s`: %s", argv[1], strerror(errno));
+    die("Couldn't open `%s`: %s", fname, strerror(errno));
   }
+  colour = isatty(STDOUT_FILENO);
+  // even on a terminal, a line at a time is too slow for big programs.
+  setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+
+  Decoder d;
+  if (!openDecoder(&d, in))
+    die("`%s` is not bytecode: %s", fname, d.error);
+  if (d.container)
+    printHeader(&d.header);
 
-  for (Instruction *i = fetchInstruction(in); i != NULL;
-       freeInstruction(i), i = fetchInstruction(in)) {
-    printInstruction(i);
+  if (stats) {
+    printStats(&d);
+  } else {
+    Instruction i;
+    DecodeStatus status;
+    while ((status = decodeInstruction(&d, &i)) == DECODE_OK)
+      printInstruction(&i);
+    // show everything up to the error.
+    fflush(stdout);
+    if (status == DECODE_ERROR)
+      die("at byte %lu: %s", d.offset, d.error);
   }
 
+  closeDecoder(&d);
   fclose(in);
 
   return 0;
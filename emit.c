@@ -0,0 +1,190 @@
+#include "emit.h"
+#include "common.h"
+#include "instruction.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// make room for <n> more bytes.
+static u8 *reserve(Emitter *e, usize n) {
+  if (e->len + n > e->cap) {
+    usize cap = e->cap == 0 ? 4096 : e->cap;
+    while (cap < e->len + n)
+      cap *= 2;
+    e->bytes = realloc(e->bytes, cap);
+    assert(e->bytes != NULL, "out of memory for %lu bytes of bytecode", cap);
+    e->cap = cap;
+  }
+  u8 *at = e->bytes + e->len;
+  e->len += n;
+  return at;
+}
+
+void emitByte(Emitter *e, u8 b) { *reserve(e, 1) = b; }
+
+void emitI32(Emitter *e, i32 value) { memcpy(reserve(e, 4), &value, 4); }
+
+void emitBytes(Emitter *e, const void *bytes, usize len) {
+  // <bytes> may be NULL then, which memcpy doesn't allow.
+  if (len == 0)
+    return;
+  memcpy(reserve(e, len), bytes, len);
+}
+
+void emitStr(Emitter *e, const char *str) {
+  emitBytes(e, str, strlen(str) + 1);
+}
+
+// the reverse of `decodeInstruction`.
+void emitInstruction(Emitter *e, const Instruction *inst) {
+  emitByte(e, inst->type);
+  switch (inst->type) {
+  case I_DIE:
+    emitStr(e, inst->die.errmsg);
+    break;
+  case I_ASSERT:
+    emitI32(e, inst->assert.expected);
+    emitStr(e, inst->assert.msg);
+    break;
+  case I_PSH_STR:
+  case I_WRITE:
+    emitI32(e, inst->str.len);
+    emitBytes(e, inst->str.bytes, inst->str.len);
+    break;
+  case I_PSH_I32:
+    emitI32(e, inst->push.value);
+    break;
+  case I_LOOP:
+    emitI32(e, inst->loop.count);
+    break;
+  case I_LOOP_IDX:
+    emitI32(e, inst->index.depth);
+    break;
+  case I_PROC:
+  case I_CALL:
+    emitI32(e, inst->proc.id);
+    break;
+  case I_READ_CHUNK:
+    emitI32(e, inst->chunk.size);
+    break;
+  case I_VEC:
+    emitI32(e, inst->vec.len);
+    break;
+  case I_HEAP:
+    emitI32(e, inst->heap.objects);
+    break;
+  default:
+    break;
+  }
+}
+
+// the strings of a container. Each is put once, a table of their offsets
+// finds them again.
+typedef struct {
+  Emitter bytes;
+  uint32_t *offsets; // UINT32_MAX where empty
+  usize cap;         // a power of two
+  usize len;
+} Pool;
+
+static uint64_t hash(const char *str) {
+  uint64_t h = 14695981039346656037u;
+  for (; *str; str++)
+    h = (h ^ (u8)*str) * 1099511628211u;
+  return h;
+}
+
+static void grow_pool(Pool *pool) {
+  uint32_t *old = pool->offsets;
+  usize old_cap = pool->cap;
+  pool->cap = old_cap == 0 ? 64 : old_cap * 2;
+  pool->offsets = malloc(pool->cap * sizeof(*pool->offsets));
+  memset(pool->offsets, 0xff, pool->cap * sizeof(*pool->offsets));
+  for (usize i = 0; i < old_cap; i++) {
+    if (old[i] == UINT32_MAX)
+      continue;
+    usize at = hash((char *)&pool->bytes.bytes[old[i]]) & (pool->cap - 1);
+    while (pool->offsets[at] != UINT32_MAX)
+      at = (at + 1) & (pool->cap - 1);
+    pool->offsets[at] = old[i];
+  }
+  free(old);
+}
+
+// where <str> is in the pool, putting it there the first time.
+static uint32_t pooled(Pool *pool, const char *str) {
+  if (2 * (pool->len + 1) > pool->cap)
+    grow_pool(pool);
+  usize at = hash(str) & (pool->cap - 1);
+  for (; pool->offsets[at] != UINT32_MAX; at = (at + 1) & (pool->cap - 1)) {
+    if (strcmp((char *)&pool->bytes.bytes[pool->offsets[at]], str) == 0)
+      return pool->offsets[at];
+  }
+  assert(pool->bytes.len < UINT32_MAX, "too many strings for a container");
+  pool->offsets[at] = pool->bytes.len;
+  pool->len++;
+  emitStr(&pool->bytes, str);
+  return pool->offsets[at];
+}
+
+void emitProgram(Emitter *e, const Program *p, usize max_depth) {
+  Pool pool = {0};
+  Emitter code = {0};
+  for (usize pc = 0; pc < p->len; pc++) {
+    const Instruction *inst = &p->code[pc];
+    if (inst->type == I_DIE) {
+      emitByte(&code, I_DIE);
+      emitI32(&code, pooled(&pool, inst->die.errmsg));
+    } else if (inst->type == I_ASSERT) {
+      emitByte(&code, I_ASSERT);
+      emitI32(&code, inst->assert.expected);
+      emitI32(&code, pooled(&pool, inst->assert.msg));
+    } else if (inst->type == I_PSH_I32 && inst->push.value >= INT8_MIN &&
+               inst->push.value <= INT8_MAX) {
+      // most pushes are characters and small counts.
+      emitByte(&code, I_PSH_I8);
+      emitByte(&code, (int8_t)inst->push.value);
+    } else {
+      emitInstruction(&code, inst);
+    }
+  }
+  assert(code.len <= UINT32_MAX, "%lu bytes of code don't fit a container",
+         code.len);
+
+  BytecodeHeader header = {
+      .magic = BYTECODE_MAGIC,
+      .version = BYTECODE_VERSION,
+      .instructions = p->len,
+      .max_depth = max_depth,
+      .code_size = code.len,
+      .strings_size = pool.bytes.len,
+  };
+  usize start = e->len;
+  emitBytes(e, &header, sizeof(header));
+  emitBytes(e, pool.bytes.bytes, pool.bytes.len);
+  while ((e->len - start) % BYTECODE_ALIGN != 0)
+    emitByte(e, 0);
+  emitBytes(e, code.bytes, code.len);
+
+  freeEmitter(&code);
+  freeEmitter(&pool.bytes);
+  free(pool.offsets);
+}
+
+bool flushEmitter(Emitter *e, int fd) {
+  usize done = 0;
+  while (done < e->len) {
+    ssize_t n = write(fd, e->bytes + done, e->len - done);
+    if (n < 0)
+      return false;
+    done += n;
+  }
+  e->len = 0;
+  return true;
+}
+
+void freeEmitter(Emitter *e) {
+  free(e->bytes);
+  *e = (Emitter){0};
+}
@@ -0,0 +1,32 @@
+#ifndef __EMIT_H__
+#define __EMIT_H__
+
+#include "common.h"
+#include "instruction.h"
+#include <stdbool.h>
+
+// bytecode written to memory, in the format `decodeInstruction` reads. It's
+// only written out when flushed, in as few writes as possible.
+// A zeroed emitter is empty and ready to use.
+typedef struct {
+  u8 *bytes;
+  usize len;
+  usize cap;
+} Emitter;
+
+void emitByte(Emitter *e, u8 b);
+void emitI32(Emitter *e, i32 value);
+void emitBytes(Emitter *e, const void *bytes, usize len);
+// <str> with its zero byte.
+void emitStr(Emitter *e, const char *str);
+// <inst> in the raw format.
+void emitInstruction(Emitter *e, const Instruction *inst);
+// <p> in a container, see BytecodeHeader. <max_depth> is 0 if not known.
+void emitProgram(Emitter *e, const Program *p, usize max_depth);
+
+// write everything emitted to <fd> and empty the emitter. Returns false on
+// error, with errno set.
+bool flushEmitter(Emitter *e, int fd);
+void freeEmitter(Emitter *e);
+
+#endif // !__EMIT_H__
@@ -1,171 +1,18 @@
 #define _GNU_SOURCE
 #include "common.h"
 #include "instruction.h"
-#include <ctype.h>
+#include "vm.h"
 #include <errno.h>
 #include <stdbool.h>
-#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-typedef enum { OBJ_INT, OBJ_PAIR } ObjType;
-
-typedef struct _object {
-  ObjType type;
-  bool is_marked; // useful for GC
-  // IMO not needing this.
-  // GC can collect from its stack if it marks the pointers
-  // correctly (using NULLs when popping).
-  // with this, we're maintaining double stack. This, although
-  // not really a problem (just 8 bytes) is not necessary.
-  struct _object *next;
-
-  union {
-    /* OBJ_INT */
-    i32 value;
-
-    /* OBJ_PAIR */
-    struct {
-      struct _object *head;
-      struct _object *tail;
-    };
-  };
-} Object;
-
-// VM
-#define STACK_MAX 256
-#define INITIAL_GC_THRESHOLD 100
-
-typedef struct {
-  Object *stack[STACK_MAX];
-  Object *first;
-  i32 stack_size;
-  i32 num_objects;
-  i32 max_objects;
-  bool has_halted;
-} VM;
-
-VM *newVM() {
-  VM *vm = malloc(sizeof(*vm));
-  memset(vm, 0, sizeof(*vm));
-  vm->max_objects = INITIAL_GC_THRESHOLD;
-  return vm;
-}
-
-void push(VM *vm, Object *value) {
-  assert(vm->stack_size < STACK_MAX, "Stack overflow");
-  vm->stack[vm->stack_size++] = value;
-}
-
-Object *pop(VM *vm) {
-  assert(vm->stack_size > 0, "Stack underflow");
-  return vm->stack[--vm->stack_size];
-}
-
-void gc(VM *);
-
-Object *newObject(VM *vm, ObjType type) {
-  if (vm->num_objects == vm->max_objects)
-    gc(vm);
-
-  Object *object = malloc(sizeof(*object));
-  object->next = NULL;
-  object->type = type;
-  object->is_marked = false;
-
-  // prepend new object
-  object->next = vm->first;
-  vm->first = object;
-  vm->num_objects++;
-
-  return object;
-}
-
-// Push a single integer value.
-void pushInt(VM *vm, i32 intValue) {
-  Object *object = newObject(vm, OBJ_INT);
-  object->value = intValue;
-  push(vm, object);
-}
-
-/// Pop last two values and put them in a pair.
-Object *pushPair(VM *vm) {
-  Object *obj = newObject(vm, OBJ_PAIR);
-  obj->tail = pop(vm);
-  obj->head = pop(vm);
-
-  push(vm, obj);
-  return obj;
-}
-
-void mark(Object *obj) {
-  if (obj->is_marked)
-    return;
-  obj->is_marked = true;
-  if (obj->type == OBJ_PAIR) {
-    mark(obj->head);
-    mark(obj->tail);
-  }
-}
-
-// mark all reachable objects.
-void markAll(VM *vm) {
-  for (usize i = 0; i < vm->stack_size; i++) {
-    mark(vm->stack[i]);
-  }
-}
-
-void sweep(VM *vm) {
-  Object **object = &vm->first;
-  while (*object) {
-    if (!(*object)->is_marked) {
-      /* This object wasn't reached, so remove it from the list and free it. */
-      Object *unreached = *object;
-
-      *object = unreached->next;
-
-      free(unreached);
-
-      vm->num_objects--;
-    } else {
-      /* This object was reached, so unmark it (for the next GC) and move on to
-       the next. */
-      (*object)->is_marked = 0;
-      object = &(*object)->next;
-    }
-  }
-}
-
-void gc(VM *vm) {
-  markAll(vm);
-  sweep(vm);
-  vm->max_objects = vm->num_objects * 2;
-}
-
-void objPrint(const Object *obj) {
-  switch (obj->type) {
-  case OBJ_INT:
-    putchar(obj->value);
-    break;
-  case OBJ_PAIR:
-    objPrint(obj->head);
-    objPrint(obj->tail);
-    break;
-    // putchar('(');
-    // objPrint(obj->head);
-    // printf(", ");
-    // objPrint(obj->tail);
-    // putchar(')');
-  }
-}
-
-void freeVM(VM *vm) {
-  vm->stack_size = 0;
-  gc(vm);
-  free(vm);
-}
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
 
 void test1() {
   printf("Test 1: Objects on stack are preserved.\n");
@@ -242,86 +89,366 @@ void perfTest() {
   freeVM(vm);
 }
 
-void swap(VM *vm) {
-  Object *obj1 = pop(vm);
-  Object *obj2 = pop(vm);
-  push(vm, obj1);
-  push(vm, obj2);
+// what `--profile` collects, per instruction type.
+typedef struct {
+  usize count[I_WRITE + 1];
+  // including the time spent collecting, which is also in `gc_ticks` of the
+  // instruction that needed the room.
+  uint64_t ticks[I_WRITE + 1];
+  uint64_t gc_ticks[I_WRITE + 1];
+} Profile;
+
+// a timestamp for profiling: the cycle counter where there's one, nanoseconds
+// otherwise.
+#if defined(__x86_64__) || defined(__i386__)
+#define TICKS "cycles"
+static inline uint64_t ticks(void) { return __rdtsc(); }
+#else
+#define TICKS "ns"
+static inline uint64_t ticks(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
+#endif
+
+// Run the program from `vm->pc`. The program must have been verified with
+// `verifyProgram` and fit in the VM's limits, so nothing that the verifier
+// knows about is checked again here.
+// The top of the stack is kept in `tos` and the rest of it in `vm->stack[0 ..
+// sp]`, so most instructions don't touch the stack in memory. `tos` is NULL
+// when the stack is empty. Before anything that may collect, the top is
+// spilled back so `markAll` sees every root.
+// This is inlined once for each combination of <prof> and <trace> that is
+// used, so the code for whichever of them is NULL folds away.
+static inline __attribute__((always_inline)) void
+runLoop(VM *vm, const Program *p, Profile *prof, Trace *trace) {
+  Object **stack = vm->stack;
+  i32 sp = vm->stack_size;
+  Object *tos = sp > 0 ? stack[--sp] : NULL;
+  usize pc = vm->pc;
+
+#define SPILL()                                                                \
+  do {                                                                         \
+    vm->stack_size = sp;                                                       \
+    if (tos)                                                                   \
+      stack[vm->stack_size++] = tos;                                           \
+  } while (0)
+#define PUSH(o)                                                                \
+  do {                                                                         \
+    if (tos)                                                                   \
+      stack[sp++] = tos;                                                       \
+    tos = (o);                                                                 \
+  } while (0)
+#define DROP() (tos = sp > 0 ? stack[--sp] : NULL)
+#define COLLECT()                                                              \
+  do {                                                                         \
+    SPILL();                                                                   \
+    if (trace)                                                                 \
+      traceEvent(trace, TRACE_GC_BEGIN, i->type, pc - 1, vm->stack_size,       \
+                 vm->num_objects);                                             \
+    if (prof) {                                                                \
+      uint64_t gc_start = ticks();                                             \
+      gc(vm);                                                                  \
+      prof->gc_ticks[i->type] += ticks() - gc_start;                           \
+    } else {                                                                   \
+      gc(vm);                                                                  \
+    }                                                                          \
+    if (trace)                                                                 \
+      traceEvent(trace, TRACE_GC_END, i->type, pc - 1, vm->stack_size,         \
+                 vm->num_objects);                                             \
+  } while (0)
+// make room for an allocation.
+#define MAYBE_GC()                                                             \
+  do {                                                                         \
+    if (needsGC(vm))                                                           \
+      COLLECT();                                                               \
+  } while (0)
+
+  while (pc < p->len && !vm->has_halted) {
+    const Instruction *i = &p->code[pc++];
+    uint64_t start = prof ? ticks() : 0;
+    if (trace)
+      traceEvent(trace, TRACE_OP, i->type, pc - 1, sp + (tos != NULL),
+                 vm->num_objects);
+
+    switch (i->type) {
+    case I_DIE:
+      die("program error: %s", i->die.errmsg);
+    case I_HALT:
+      vm->has_halted = true;
+      flushOutput(vm);
+      break;
+    case I_POP:
+      DROP();
+      break;
+    case I_FREE: {
+      Object *o = tos;
+      DROP();
+      freeTree(vm, o);
+    } break;
+    case I_PRINT:
+      objPrint(vm, tos);
+      break;
+    case I_READ_I32: {
+      i32 ch = readByte(vm);
+      MAYBE_GC();
+      Object *o = allocObject(vm, OBJ_INT);
+      o->value = ch;
+      PUSH(o);
+    } break;
+    case I_READ_LINE:
+    case I_READ_CHUNK: {
+      usize len;
+      if (i->type == I_READ_LINE) {
+        len = readBytes(vm, SIZE_MAX, '\n');
+      } else {
+        len = readBytes(vm, i->chunk.size, EOF);
+      }
+      // collect at most once for the whole list.
+      if (vm->num_objects + bytesListSize(len) > (usize)vm->max_objects)
+        COLLECT();
+      PUSH(bytesList(vm, vm->read_buf, len));
+    } break;
+    case I_PSH_I32: {
+      MAYBE_GC();
+      Object *o = allocObject(vm, OBJ_INT);
+      o->value = i->push.value;
+      PUSH(o);
+    } break;
+    case I_PSH_STR: {
+      MAYBE_GC();
+      PUSH(allocBytes(vm, i->str.bytes, i->str.len));
+    } break;
+    case I_WRITE:
+      outBytes(vm, (const u8 *)i->str.bytes, i->str.len);
+      if (vm->out.line_buffered && memchr(i->str.bytes, '\n', i->str.len))
+        flushOutput(vm);
+      break;
+    case I_PAIR: {
+      MAYBE_GC();
+      Object *o = allocObject(vm, OBJ_PAIR);
+      o->tail = tos;
+      o->head = stack[--sp];
+      tos = o;
+    } break;
+    case I_VEC: {
+      i32 n = i->vec.len;
+      MAYBE_GC();
+      Object *o = allocVec(vm, n);
+      if (n > 0) {
+        // the bottom-most value goes first.
+        o->items[n - 1] = tos;
+        sp -= n - 1;
+        memcpy(o->items, &stack[sp], (n - 1) * sizeof(*o->items));
+        tos = o;
+      } else {
+        PUSH(o);
+      }
+    } break;
+    case I_VEC_GET: {
+      const Object *v = stack[sp - 1];
+      assert(tos->type == OBJ_INT, "vec_get: index must be a number");
+      assert(v->type == OBJ_VEC, "vec_get: not a vector");
+      i32 index = tos->value;
+      assert(index >= 0 && (usize)index < v->items_len,
+             "vec_get: index %d out of bounds for length %lu", index,
+             v->items_len);
+      tos = v->items[index];
+    } break;
+    case I_VEC_LEN: {
+      assert(tos->type == OBJ_VEC, "vec_len: not a vector");
+      usize len = tos->items_len;
+      MAYBE_GC();
+      Object *o = allocObject(vm, OBJ_INT);
+      o->value = len;
+      PUSH(o);
+    } break;
+    case I_DUP:
+      PUSH(tos);
+      break;
+    case I_OVER: {
+      // PUSH spills the top into the stack first.
+      Object *o = stack[sp - 1];
+      PUSH(o);
+    } break;
+    case I_ROT: {
+      // a b c -> b c a
+      Object *a = stack[sp - 2];
+      stack[sp - 2] = stack[sp - 1];
+      stack[sp - 1] = tos;
+      tos = a;
+    } break;
+    case I_HEAD:
+    case I_TAIL:
+      assert(tos->type == OBJ_PAIR, "%s: not a pair", inames[i->type]);
+      tos = i->type == I_HEAD ? tos->head : tos->tail;
+      break;
+    case I_SWP: {
+      Object *o = stack[sp - 1];
+      stack[sp - 1] = tos;
+      tos = o;
+    } break;
+    case I_GC:
+      COLLECT();
+      break;
+    case I_ASSERT:
+      assert(vm->num_objects == i->assert.expected, "%s", i->assert.msg);
+      break;
+    case I_LOOP:
+      if (i->loop.count <= 0) {
+        pc = skipLoop(p, pc);
+        break;
+      }
+      vm->loops[vm->loop_depth++] =
+          (Loop){.index = 0, .count = i->loop.count, .start = pc};
+      break;
+    case I_ENDLOOP: {
+      Loop *l = &vm->loops[vm->loop_depth - 1];
+      if (++l->index < l->count)
+        pc = l->start;
+      else
+        vm->loop_depth--;
+    } break;
+    case I_LOOP_IDX: {
+      MAYBE_GC();
+      Object *o = allocObject(vm, OBJ_INT);
+      o->value = vm->loops[vm->loop_depth - 1 - i->index.depth].index;
+      PUSH(o);
+    } break;
+    case I_HEAP:
+      // already reserved by `run`.
+      break;
+    case I_PROC:
+      // the body only runs when called.
+      pc = p->procs[i->proc.id].end;
+      break;
+    case I_CALL:
+      vm->rets[vm->call_depth++] = pc;
+      pc = p->procs[i->proc.id].start;
+      break;
+    case I_RET:
+      pc = vm->rets[--vm->call_depth];
+      break;
+    }
 
-void interpret(VM *vm, const Instruction *i) {
-  switch (i->type) {
-  case I_DIE:
-    die("program error: %s", i->die.errmsg);
-  case I_HALT:
-    vm->has_halted = true;
-    break;
-  case I_POP:
-    pop(vm);
-    break;
-  case I_PRINT: {
-    Object *o = pop(vm);
-    objPrint(o);
-    push(vm, o);
-  } break;
-  case I_READ_I32: {
-    i32 ch = getchar();
-    pushInt(vm, ch);
-    break;
-  }
-  case I_PSH_I32:
-    pushInt(vm, i->push.value);
-    break;
-  case I_PAIR:
-    pushPair(vm);
-    break;
-  case I_SWP:
-    swap(vm);
-    break;
-  case I_GC:
-    gc(vm);
-    break;
-  case I_ASSERT:
-    assert(vm->num_objects == i->assert.expected, "%s", i->assert.msg);
-    break;
+    if (prof) {
+      prof->count[i->type]++;
+      prof->ticks[i->type] += ticks() - start;
+    }
   }
+
+  SPILL();
+  vm->pc = pc;
+
+#undef SPILL
+#undef PUSH
+#undef DROP
+#undef COLLECT
+#undef MAYBE_GC
 }
 
-void _run(VM *vm, FILE *fp) {
-  Instruction *i;
+void _run(VM *vm, const Program *p) {
+  if (vm->trace)
+    runLoop(vm, p, NULL, vm->trace);
+  else
+    runLoop(vm, p, NULL, NULL);
+}
 
-  while ((i = fetchInstruction(fp)) != NULL && !vm->has_halted) {
-    interpret(vm, i);
-    // no jump instruction -> never goes back.
-    freeInstruction(i);
+void _runProfiled(VM *vm, const Program *p, Profile *prof) {
+  runLoop(vm, p, prof, vm->trace);
+}
+
+// print the instructions that ran, the slowest first.
+static void printProfile(const Profile *prof) {
+  IType order[I_WRITE + 1];
+  usize len = 0;
+  uint64_t total = 0;
+  for (usize t = 0; t <= I_WRITE; t++) {
+    if (prof->count[t] == 0)
+      continue;
+    total += prof->ticks[t];
+    // insertion sort, there are only a few of them.
+    usize at = len++;
+    for (; at > 0 && prof->ticks[order[at - 1]] < prof->ticks[t]; at--)
+      order[at] = order[at - 1];
+    order[at] = t;
+  }
+
+  fprintf(stderr, "%-16s %12s %14s %10s %14s %6s\n", "instruction", "count",
+          TICKS, "per op", "gc " TICKS, "%");
+  for (usize k = 0; k < len; k++) {
+    IType t = order[k];
+    fprintf(stderr, "%-16s %12lu %14lu %10.1f %14lu %5.1f%%\n", inames[t],
+            prof->count[t], prof->ticks[t],
+            (double)prof->ticks[t] / prof->count[t], prof->gc_ticks[t],
+            total ? 100.0 * prof->ticks[t] / total : 0.0);
   }
 }
 
-void run(const char *filename) {
+void run(const char *filename, bool line_buffered, bool profile,
+         const char *trace) {
   FILE *fp = filename == NULL ? stdin : fopen(filename, "rb");
   assert(fp != NULL, "%s", strerror(errno));
 
+  Program p = loadProgram(fp);
+  if (fp != stdin)
+    fclose(fp);
+
+  checkProgram(&p);
+
   VM *vm = newVM();
-  _run(vm, fp);
+  vm->out.line_buffered = line_buffered;
+  setRunningVM(vm);
+  if (trace != NULL)
+    startTrace(vm, trace);
+  if (p.len > 0 && p.code[0].type == I_HEAP)
+    reserveHeap(vm, p.code[0].heap.objects);
+
+  if (profile) {
+    Profile prof = {0};
+    _runProfiled(vm, &p, &prof);
+    printProfile(&prof);
+  } else {
+    _run(vm, &p);
+  }
+  if (vm->trace)
+    dumpTrace(vm);
 
+  setRunningVM(NULL);
   freeVM(vm);
-  if (fp != stdin)
-    fclose(fp);
+  freeProgram(&p);
 }
 
 int main(int argc, const char *argv[]) {
-  setvbuf(stdout, NULL, _IONBF, 0);
-
   const char *fname = NULL;
-  if (argc > 0 && argc != 2) {
-    printf("Usage: %s [<file>]\n", *argv);
-    return 1;
-  }
-  if (argc == 2) {
-    fname = argv[1];
+  bool line_buffered = false;
+  bool profile = false;
+  const char *trace = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0) {
+      line_buffered = true;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profile = true;
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace = argv[++i];
+    } else if (fname == NULL && argv[i][0] != '-') {
+      fname = argv[i];
+    } else {
+      printf("Usage: %s [-l] [--profile] [--trace <out>] [<file>]\n",
+             *argv);
+      printf("  -l             flush the output after every newline\n");
+      printf("  --profile      time every instruction and print a table to "
+             "stderr at the end\n");
+      printf("  --trace <out>  write the last %d events to <out> at the end, "
+             "see tracedump\n",
+             TRACE_EVENTS);
+      return 1;
+    }
   }
 
-  run(fname);
+  run(fname, line_buffered, profile, trace);
 
   return 0;
 }
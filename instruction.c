@@ -2,10 +2,13 @@
 #include "instruction.h"
 #include "common.h"
 #include <errno.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 const char *inames[] = {
     [I_ASSERT] = "assert_allocated",
@@ -18,90 +21,529 @@ const char *inames[] = {
     [I_SWP] = "swap",
     [I_HALT] = "halt",
     [I_DIE] = "die",
+    [I_LOOP] = "loop",
+    [I_ENDLOOP] = "endloop",
+    [I_LOOP_IDX] = "index",
+    [I_PROC] = "proc",
+    [I_RET] = "ret",
+    [I_CALL] = "call",
+    [I_READ_LINE] = "in_line",
+    [I_READ_CHUNK] = "in_chunk",
+    [I_PSH_STR] = "push_str",
+    [I_VEC] = "vec",
+    [I_VEC_GET] = "vec_get",
+    [I_VEC_LEN] = "vec_len",
+    [I_DUP] = "dup",
+    [I_OVER] = "over",
+    [I_ROT] = "rot",
+    [I_HEAD] = "head",
+    [I_TAIL] = "tail",
+    [I_HEAP] = "heap",
+    [I_FREE] = "free",
+    [I_WRITE] = "write",
 };
 
-void freeInstruction(Instruction *inst) {
-  assert(inst != NULL, "attempting to free null pointer");
+void releaseInstruction(Instruction *inst) {
   if (inst->type == I_ASSERT)
     free((void *)inst->assert.msg);
   else if (inst->type == I_DIE)
     free((void *)inst->die.errmsg);
-  free(inst);
+  else if (inst->type == I_PSH_STR || inst->type == I_WRITE)
+    free((void *)inst->str.bytes);
 }
 
-char *read_raw_str(FILE *in) {
-  u8 b = 0;
-  char *buf = calloc(4, sizeof(char));
-  usize cap = 4;
-  usize len = 0;
+// what follows each instruction code.
+typedef enum {
+  OPERAND_BAD, // not an instruction
+  OPERAND_NONE,
+  OPERAND_I8,
+  OPERAND_I32,
+  OPERAND_BYTES,   // 4byte length and that many bytes
+  OPERAND_STR,     // zero terminated, or its 4byte offset in a container
+  OPERAND_I32_STR, // 4byte int and then OPERAND_STR
+} Operand;
 
-  for (; fread(&b, 1, 1, in) == 1 && b != 0;) {
-    if (len == cap) {
-      cap *= 2;
-      buf = reallocarray(buf, cap, sizeof(char));
+static const u8 operands[256] = {
+    [I_PRINT] = OPERAND_NONE,        [I_READ_I32] = OPERAND_NONE,
+    [I_PSH_I32] = OPERAND_I32,       [I_PAIR] = OPERAND_NONE,
+    [I_SWP] = OPERAND_NONE,          [I_POP] = OPERAND_NONE,
+    [I_HALT] = OPERAND_NONE,         [I_DIE] = OPERAND_STR,
+    [I_LOOP] = OPERAND_I32,          [I_ENDLOOP] = OPERAND_NONE,
+    [I_LOOP_IDX] = OPERAND_I32,      [I_PROC] = OPERAND_I32,
+    [I_RET] = OPERAND_NONE,          [I_CALL] = OPERAND_I32,
+    [I_READ_LINE] = OPERAND_NONE,    [I_READ_CHUNK] = OPERAND_I32,
+    [I_GC] = OPERAND_NONE,           [I_PSH_STR] = OPERAND_BYTES,
+    [I_ASSERT] = OPERAND_I32_STR,    [I_VEC] = OPERAND_I32,
+    [I_VEC_GET] = OPERAND_NONE,      [I_VEC_LEN] = OPERAND_NONE,
+    [I_DUP] = OPERAND_NONE,          [I_OVER] = OPERAND_NONE,
+    [I_ROT] = OPERAND_NONE,          [I_HEAD] = OPERAND_NONE,
+    [I_TAIL] = OPERAND_NONE,         [I_HEAP] = OPERAND_I32,
+    [I_FREE] = OPERAND_NONE,         [I_WRITE] = OPERAND_BYTES,
+    [I_PSH_I8] = OPERAND_I8,
+};
+
+static DecodeStatus __attribute__((format(printf, 2, 3)))
+decode_error(Decoder *d, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(d->error, sizeof(d->error), fmt, args);
+  va_end(args);
+  return DECODE_ERROR;
+}
+
+// the next <n> bytes, reading more of the file if they aren't there. NULL if
+// it ends before.
+static const u8 *peek(Decoder *d, usize n) {
+  if (d->len - d->pos >= n)
+    return d->bytes + d->pos;
+  if (d->in == NULL)
+    return NULL;
+
+  // keep what's left at the start of the buffer, and fill the rest.
+  usize left = d->len - d->pos;
+  memmove(d->buf, d->bytes + d->pos, left);
+  d->pos = 0;
+  d->len = left;
+  if (n > d->cap) {
+    // only for strings longer than the buffer.
+    while (d->cap < n)
+      d->cap *= 2;
+    d->buf = realloc(d->buf, d->cap);
+    assert(d->buf != NULL, "out of memory for %lu bytes of bytecode", d->cap);
+  }
+  d->bytes = d->buf;
+  while (d->len < n) {
+    usize got = fread(d->buf + d->len, 1, d->cap - d->len, d->in);
+    if (got == 0)
+      return NULL;
+    d->len += got;
+  }
+  return d->bytes;
+}
+
+// read the header and pool of a container, if it is one.
+static DecodeStatus open_container(Decoder *d) {
+  const u8 *at = peek(d, 1);
+  if (at == NULL || *at != BYTECODE_MAGIC[0])
+    return DECODE_OK;
+
+  BytecodeHeader *h = &d->header;
+  if ((at = peek(d, sizeof(*h))) == NULL)
+    return decode_error(d, "truncated header");
+  memcpy(h, at, sizeof(*h));
+  if (memcmp(h->magic, BYTECODE_MAGIC, sizeof(h->magic)) != 0)
+    return decode_error(d, "bad header");
+  if (h->version < 1 || h->version > BYTECODE_VERSION)
+    return decode_error(d, "version %u, expected at most %d", h->version,
+                        BYTECODE_VERSION);
+  // every instruction takes at least a byte.
+  if (h->instructions > h->code_size)
+    return decode_error(d, "%u instructions in %u bytes", h->instructions,
+                        h->code_size);
+  d->container = true;
+  d->pos += sizeof(*h);
+  d->offset += sizeof(*h);
+
+  usize pad = -(sizeof(*h) + h->strings_size) % BYTECODE_ALIGN;
+  if ((at = peek(d, h->strings_size + pad)) == NULL)
+    return decode_error(d, "expected %u bytes of strings", h->strings_size);
+  if (h->strings_size > 0 && at[h->strings_size - 1] != 0)
+    return decode_error(d, "the last string isn't terminated");
+  if (d->in == NULL) {
+    d->pool = (const char *)at;
+  } else {
+    // the buffer is reused, the pool has to outlive it.
+    d->own_pool = malloc(h->strings_size);
+    memcpy(d->own_pool, at, h->strings_size);
+    d->pool = d->own_pool;
+  }
+  d->pos += h->strings_size + pad;
+  d->offset += h->strings_size + pad;
+  return DECODE_OK;
+}
+
+bool openDecoder(Decoder *d, FILE *in) {
+  *d = (Decoder){.in = in, .cap = DECODE_BUFFER};
+  d->buf = malloc(d->cap);
+  d->bytes = d->buf;
+  return open_container(d) == DECODE_OK;
+}
+
+bool openDecoderMemory(Decoder *d, const void *bytes, usize len) {
+  *d = (Decoder){.bytes = bytes, .len = len};
+  return open_container(d) == DECODE_OK;
+}
+
+void closeDecoder(Decoder *d) {
+  free(d->buf);
+  free(d->own_pool);
+  d->buf = NULL;
+  d->own_pool = NULL;
+}
+
+// a `die` or `assert` message <at> bytes into the instruction, inline or in
+// the pool. Sets *size to where the instruction ends.
+static const char *decode_str(Decoder *d, usize at, usize *size) {
+  if (d->container) {
+    const u8 *bytes = peek(d, at + 4);
+    if (bytes == NULL)
+      return NULL;
+    uint32_t offset;
+    memcpy(&offset, bytes + at, 4);
+    if (offset >= d->header.strings_size)
+      return NULL;
+    *size = at + 4;
+    return &d->pool[offset];
+  }
+
+  // look for the zero byte, reading more till it's there.
+  for (usize searched = at;;) {
+    const u8 *bytes = peek(d, searched);
+    if (bytes == NULL)
+      return NULL;
+    const u8 *end = memchr(bytes + searched, 0, d->len - d->pos - searched);
+    if (end != NULL) {
+      *size = end - bytes + 1;
+      return (const char *)bytes + at;
     }
-    buf[len] = b;
-    len++;
+    searched = d->len - d->pos;
+    if (peek(d, searched + 1) == NULL)
+      return NULL;
   }
+}
 
-  if (errno) {
-    die("while reading fron input: %s", strerror(errno));
+DecodeStatus decodeInstruction(Decoder *d, Instruction *inst) {
+  if (d->container && d->decoded == d->header.instructions)
+    return DECODE_END;
+  const u8 *at = peek(d, 1);
+  if (at == NULL) {
+    if (d->in != NULL && ferror(d->in))
+      return decode_error(d, "%s", strerror(errno));
+    if (d->container)
+      return decode_error(d, "expected %u instructions, got %lu",
+                          d->header.instructions, d->decoded);
+    return DECODE_END;
   }
 
-  if (len == cap) {
-    cap++;
-    buf = reallocarray(buf, cap, sizeof(char));
+  u8 first = *at;
+  usize size = 1;
+  switch (operands[first]) {
+  case OPERAND_BAD:
+    return decode_error(d, "not a known instruction code: 0x%x", first);
+  case OPERAND_NONE:
+    break;
+  case OPERAND_I8:
+    if ((at = peek(d, 2)) == NULL)
+      return decode_error(d, "push: expected constant");
+    inst->push.value = (int8_t)at[1];
+    first = I_PSH_I32;
+    size = 2;
+    break;
+  case OPERAND_I32:
+    if ((at = peek(d, 5)) == NULL)
+      return decode_error(d, "%s: expected constant", inames[first]);
+    // every operand is the first field of its struct.
+    memcpy(&inst->push.value, at + 1, 4);
+    size = 5;
+    break;
+  case OPERAND_BYTES: {
+    i32 len;
+    if ((at = peek(d, 5)) == NULL || (memcpy(&len, at + 1, 4), len < 0))
+      return decode_error(d, "%s: expected length", inames[first]);
+    if ((at = peek(d, 5 + (usize)len)) == NULL)
+      return decode_error(d, "%s: expected %d bytes", inames[first], len);
+    inst->str.bytes = (const char *)at + 5;
+    inst->str.len = len;
+    size = 5 + len;
+  } break;
+  case OPERAND_STR:
+    inst->die.errmsg = decode_str(d, 1, &size);
+    if (inst->die.errmsg == NULL)
+      return decode_error(d, "die: expected message");
+    break;
+  case OPERAND_I32_STR:
+    if ((at = peek(d, 5)) == NULL)
+      return decode_error(d, "assert: expected constant");
+    memcpy(&inst->assert.expected, at + 1, 4);
+    inst->assert.msg = decode_str(d, 5, &size);
+    if (inst->assert.msg == NULL)
+      return decode_error(d, "assert: expected message");
+    break;
   }
-  buf[len] = 0;
 
-  assert(b == 0, "Expected string to end in zero byte");
+  inst->type = (IType)first;
+  d->pos += size;
+  d->offset += size;
+  d->decoded++;
+  return DECODE_OK;
+}
 
-  return buf;
+static bool __attribute__((format(printf, 3, 4)))
+index_error(BytecodeIndex *index, usize offset, const char *fmt, ...) {
+  index->error_offset = offset;
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(index->error, sizeof(index->error), fmt, args);
+  va_end(args);
+  return false;
 }
 
-Instruction *fetchInstruction(FILE *fp) {
+// the name of a valid instruction code.
+static const char *name_of(u8 code) {
+  return inames[code == I_PSH_I8 ? I_PSH_I32 : code];
+}
 
-  u8 first;
-  if (fread(&first, 1, 1, fp) != 1) {
-    assert(errno == 0, strerror(errno));
-    return NULL;
+bool indexBytecode(const void *bytes, usize len, BytecodeIndex *index) {
+  *index = (BytecodeIndex){0};
+  Decoder d;
+  if (!openDecoderMemory(&d, bytes, len)) {
+    memcpy(index->error, d.error, sizeof(index->error));
+    return false;
   }
+  if (len > UINT32_MAX)
+    return index_error(index, 0, "too big to index");
 
-  // don't allocate till we know we read something.
-  Instruction *i = malloc(sizeof(*i));
+  // a container says how many instructions there are, raw code is guessed
+  // from how long pushes and single byte instructions are.
+  usize cap = d.container ? d.header.instructions : len / 3 + 1;
+  index->offsets = malloc(cap * sizeof(*index->offsets));
+  const u8 *code = bytes;
+  usize pos = d.pos;
+  while (pos < len) {
+    if (d.container && index->len == d.header.instructions)
+      break;
+    u8 first = code[pos];
+    usize left = len - pos, size;
+    uint32_t at;
+    switch (operands[first]) {
+    default:
+      return index_error(index, pos, "not a known instruction code: 0x%x",
+                         first);
+    case OPERAND_NONE:
+      size = 1;
+      break;
+    case OPERAND_I8:
+      size = 2;
+      break;
+    case OPERAND_I32:
+      size = 5;
+      break;
+    case OPERAND_BYTES: {
+      i32 bytes_len = -1;
+      if (left >= 5)
+        memcpy(&bytes_len, &code[pos + 1], 4);
+      if (bytes_len < 0)
+        return index_error(index, pos, "%s: expected length",
+                           name_of(first));
+      size = 5 + (usize)bytes_len;
+    } break;
+    case OPERAND_STR:
+    case OPERAND_I32_STR:
+      at = operands[first] == OPERAND_STR ? 1 : 5;
+      if (d.container) {
+        uint32_t offset = UINT32_MAX;
+        if (left >= at + 4)
+          memcpy(&offset, &code[pos + at], 4);
+        if (offset >= d.header.strings_size)
+          return index_error(index, pos, "%s: bad string offset",
+                             name_of(first));
+        size = at + 4;
+      } else {
+        // memchr goes through them a vector at a time.
+        const u8 *end =
+            left > at ? memchr(&code[pos + at], 0, left - at) : NULL;
+        if (end == NULL)
+          return index_error(index, pos, "%s: string isn't terminated",
+                             name_of(first));
+        size = end - &code[pos] + 1;
+      }
+      break;
+    }
+    if (size > left)
+      return index_error(index, pos, "%s: expected operand",
+                         name_of(first));
 
-  switch (first) {
-  default:
-    die("Not a known instruction code: 0x%x\n", first);
-    exit(1);
-
-  // nothing to do.
-  case I_PAIR:
-  case I_READ_I32:
-  case I_HALT:
-  case I_SWP:
-  case I_GC:
-  case I_POP:
-  case I_PRINT:
-    break;
+    if (index->len == cap) {
+      cap *= 2;
+      index->offsets =
+          reallocarray(index->offsets, cap, sizeof(*index->offsets));
+    }
+    index->offsets[index->len++] = pos;
+    pos += size;
+  }
+  if (d.container && index->len < d.header.instructions)
+    return index_error(index, pos, "expected %u instructions, got %lu",
+                       d.header.instructions, index->len);
+  return true;
+}
 
-  case I_DIE:
-    i->die.errmsg = read_raw_str(fp);
-    break;
+void freeBytecodeIndex(BytecodeIndex *index) {
+  free(index->offsets);
+  index->offsets = NULL;
+  index->len = 0;
+}
 
+usize instructionSize(const Instruction *inst) {
+  switch (inst->type) {
+  case I_DIE:
+    return 1 + strlen(inst->die.errmsg) + 1;
+  case I_ASSERT:
+    return 1 + 4 + strlen(inst->assert.msg) + 1;
+  case I_PSH_STR:
+  case I_WRITE:
+    return 1 + 4 + inst->str.len;
   case I_PSH_I32:
-    assert(fread(&i->push.value, 4, 1, fp) == 1, "push: expected constant");
-    break;
-  case I_ASSERT: {
-    assert(fread(&i->assert.expected, 4, 1, fp) == 1,
-           "assert: expected constant");
+  case I_LOOP:
+  case I_LOOP_IDX:
+  case I_PROC:
+  case I_CALL:
+  case I_READ_CHUNK:
+  case I_VEC:
+  case I_HEAP:
+    return 1 + 4;
+  default:
+    return 1;
+  }
+}
 
-    i->assert.msg = read_raw_str(fp);
+void printInstructionCounts(const usize count[I_WRITE + 1]) {
+  bool shown[I_WRITE + 1] = {false};
+  for (;;) {
+    usize best = I_WRITE + 1;
+    for (usize t = 0; t <= I_WRITE; t++) {
+      if (!shown[t] && count[t] > 0 &&
+          (best > I_WRITE || count[t] > count[best]))
+        best = t;
+    }
+    if (best > I_WRITE)
+      break;
+    shown[best] = true;
+    printf("  %-16s %10lu\n", inames[best], count[best]);
+  }
+}
 
-  } break;
+// find where each procedure starts and ends, so calls don't need to search.
+void resolveProcs(Program *p) {
+  free(p->procs);
+  p->procs = NULL;
+  p->procs_len = 0;
+
+  for (usize pc = 0; pc < p->len; pc++) {
+    if (p->code[pc].type != I_PROC)
+      continue;
+    i32 id = p->code[pc].proc.id;
+    assert(id >= 0, "proc: negative id %d", id);
+
+    if ((usize)id >= p->procs_len) {
+      usize len = id + 1;
+      p->procs = reallocarray(p->procs, len, sizeof(*p->procs));
+      memset(&p->procs[p->procs_len], 0,
+             (len - p->procs_len) * sizeof(*p->procs));
+      p->procs_len = len;
+    }
+    Proc *proc = &p->procs[id];
+    assert(proc->end == 0, "proc: procedure %d is defined twice", id);
+
+    proc->start = pc + 1;
+    for (pc++; pc < p->len && p->code[pc].type != I_RET; pc++)
+      assert(p->code[pc].type != I_PROC, "proc: procedure %d is not closed",
+             id);
+    assert(pc < p->len, "proc: procedure %d is not closed", id);
+    proc->end = pc + 1;
   }
+}
 
-  i->type = (IType)first;
+usize skipLoop(const Program *p, usize pc) {
+  for (usize depth = 1; pc < p->len; pc++) {
+    if (p->code[pc].type == I_LOOP)
+      depth++;
+    else if (p->code[pc].type == I_ENDLOOP && --depth == 0)
+      return pc + 1;
+  }
+  return pc;
+}
+
+// copy the strings of <inst> out of the decoder.
+static void own_strings(Instruction *inst) {
+  if (inst->type == I_ASSERT) {
+    inst->assert.msg = strdup(inst->assert.msg);
+  } else if (inst->type == I_DIE) {
+    inst->die.errmsg = strdup(inst->die.errmsg);
+  } else if (inst->type == I_PSH_STR || inst->type == I_WRITE) {
+    char *bytes = malloc(inst->str.len + 1);
+    memcpy(bytes, inst->str.bytes, inst->str.len);
+    inst->str.bytes = bytes;
+  }
+}
+
+Program decodeProgram(Decoder *d) {
+  Program p;
+  usize cap = 64;
+  if (d->container && d->header.instructions > 0)
+    cap = d->header.instructions;
+  else if (d->in == NULL)
+    // raw code has pushes of 5 bytes and instructions of 1 between them.
+    cap = (d->len - d->pos) / 3 + 1;
+  p.len = 0;
+  p.procs = NULL;
+  p.code = calloc(cap, sizeof(*p.code));
+  assert(p.code != NULL, "out of memory for %lu instructions", cap);
+
+  DecodeStatus status;
+  Instruction inst;
+  while ((status = decodeInstruction(d, &inst)) == DECODE_OK) {
+    if (p.len == cap) {
+      cap *= 2;
+      p.code = reallocarray(p.code, cap, sizeof(*p.code));
+    }
+    own_strings(&inst);
+    p.code[p.len++] = inst;
+  }
+  if (status == DECODE_ERROR)
+    die("Invalid bytecode at byte %lu: %s", d->offset, d->error);
+
+  resolveProcs(&p);
+
+  return p;
+}
+
+Program loadProgram(FILE *fp) {
+  struct stat st;
+  if (ftell(fp) == 0 && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0) {
+    void *bytes =
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (bytes != MAP_FAILED) {
+      Program p = loadProgramMemory(bytes, st.st_size);
+      munmap(bytes, st.st_size);
+      return p;
+    }
+  }
+
+  Decoder d;
+  if (!openDecoder(&d, fp))
+    die("Invalid bytecode: %s", d.error);
+  Program p = decodeProgram(&d);
+  closeDecoder(&d);
+  return p;
+}
+
+Program loadProgramMemory(const void *bytes, usize len) {
+  Decoder d;
+  if (!openDecoderMemory(&d, bytes, len))
+    die("Invalid bytecode: %s", d.error);
+  Program p = decodeProgram(&d);
+  closeDecoder(&d);
+  return p;
+}
 
-  return i;
+void freeProgram(Program *p) {
+  for (usize i = 0; i < p->len; i++)
+    releaseInstruction(&p->code[i]);
+  free(p->code);
+  free(p->procs);
+  p->code = NULL;
+  p->len = 0;
+  p->procs = NULL;
+  p->procs_len = 0;
 }
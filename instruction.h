@@ -2,6 +2,7 @@
 #define __INSTRUCTION_H__
 
 #include "common.h"
+#include <stdbool.h>
 
 // instructions (very simple):
 // 0x00 -> print current from the stack.
@@ -10,9 +11,35 @@
 // 0x03                          -> pop two & push pair
 // 0x04                          -> swap the two
 // 0x05                          -> pop
+// 0x08 +4byte int               -> begin a loop that runs <int> times
+// 0x09                          -> end of the innermost loop body
+// 0x0a +4byte int               -> push the counter of the loop <int> levels
+// out from the innermost one
+// 0x0b +4byte int               -> start of the body of procedure <int>
+// 0x0c                          -> return from the current procedure
+// 0x0d +4byte int               -> call procedure <int>
+// 0x0e                          -> read a line (with its '\n') & push it
+// 0x0f +4byte int               -> read up to <int> bytes & push them
 // 0x10                          -> call GC
+// 0x11 +4byte int +<int> bytes  -> push the bytes as a single string
+// 0x13 +4byte int               -> pop <int> values & push them as a vector
+// 0x14                          -> pop index & push that item of the vector
+// under it
+// 0x15                          -> push the length of the vector
+// 0x16                          -> push the last value again
+// 0x17                          -> push the value under the last one
+// 0x18                          -> move the third value to the top
+// 0x19                          -> pop pair & push its head
+// 0x1a                          -> pop pair & push its tail
+// 0x1b +4byte int               -> hint: the program never has more than <int>
+// objects alive. Only the first instruction.
+// 0x1c                          -> pop & free the value and everything under
+// it, which nothing else refers to
+// 0x1d +4byte int +<int> bytes  -> output the bytes
 // 0x12 +4byte int +"string\0"   -> assert the number of allocated objects is
 // <int>, otherwise fail with <string>
+// 0x1e +1byte int               -> push i32 (constant, sign extended). Only in
+// containers. It's decoded as 0x02, the VM never sees it.
 
 typedef enum {
   I_PRINT = 0x00,
@@ -23,10 +50,36 @@ typedef enum {
   I_POP = 0x05,
   I_HALT = 0x06,
   I_DIE = 0x07, // prints `errmsg` to stderr and dies.
+  I_LOOP = 0x08,
+  I_ENDLOOP = 0x09,
+  I_LOOP_IDX = 0x0a,
+  I_PROC = 0x0b,
+  I_RET = 0x0c,
+  I_CALL = 0x0d,
+  I_READ_LINE = 0x0e,
+  I_READ_CHUNK = 0x0f,
   I_GC = 0x10,
+  I_PSH_STR = 0x11,
+  I_VEC = 0x13,
+  I_VEC_GET = 0x14,
+  I_VEC_LEN = 0x15,
+  I_DUP = 0x16,
+  I_OVER = 0x17,
+  I_ROT = 0x18,
+  I_HEAD = 0x19,
+  I_TAIL = 0x1a,
+  I_HEAP = 0x1b,
+  I_FREE = 0x1c,
+  I_WRITE = 0x1d,
   I_ASSERT = 0x12,
 } IType;
 
+// encodings that are decoded as another instruction, so no instruction has
+// them as its type.
+enum {
+  I_PSH_I8 = 0x1e, // I_PSH_I32 of a value that fits a byte
+};
+
 typedef struct {
   IType type;
 
@@ -41,17 +94,162 @@ typedef struct {
     struct {
       i32 value;
     } push;
+    struct {
+      i32 count;
+    } loop;
+    struct {
+      i32 depth;
+    } index;
+    struct {
+      i32 id;
+    } proc; // I_PROC & I_CALL
+    struct {
+      i32 size;
+    } chunk;
+    struct {
+      const char *bytes; // not zero terminated.
+      i32 len;
+    } str; // I_PSH_STR & I_WRITE
+    struct {
+      i32 len;
+    } vec;
+    struct {
+      i32 objects;
+    } heap;
   };
 } Instruction;
 
 struct _IO_FILE;
 typedef struct _IO_FILE FILE;
 
-// fetch an instruction from <in>. the instruction is allocated
-// and the receiver should free it.
-Instruction *fetchInstruction(FILE *in);
+// Bytecode is either the instructions above one after the other (the raw
+// format), or a container, which is what `asm` writes:
+//   BytecodeHeader
+//   strings_size bytes of string pool: the `die` and `assert` messages, each
+//   only once and zero terminated
+//   zero bytes till the code is BYTECODE_ALIGN aligned from the header
+//   code_size bytes of code: the instructions as above, except that `die`
+//   and `assert` have the 4byte offset of their message in the pool in place
+//   of the string
+// Raw bytecode starts with an instruction, and no instruction is a `G`.
+#define BYTECODE_MAGIC "GCVB"
+// version 2 added I_PSH_I8. Every older version can still be read.
+#define BYTECODE_VERSION 2
+#define BYTECODE_ALIGN 8
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t instructions; // in the code
+  uint32_t max_depth;    // values on the stack at once, 0 if not known
+  uint32_t code_size;
+  uint32_t strings_size;
+} BytecodeHeader;
+
+// bytes the decoder reads from a file at once.
+#define DECODE_BUFFER (1 << 16)
+
+typedef enum {
+  DECODE_OK,
+  DECODE_END,   // there are no more instructions
+  DECODE_ERROR, // see `error`
+} DecodeStatus;
+
+// reads bytecode in either format from a file or from memory. Nothing is
+// allocated per instruction: they're decoded into the caller's storage and
+// their strings point into the decoder.
+typedef struct {
+  FILE *in; // NULL when decoding memory
+  // bytes[pos .. len] are read and not decoded yet. With a file they're in
+  // `buf`, otherwise it's all the memory.
+  const u8 *bytes;
+  usize pos;
+  usize len;
+  u8 *buf;
+  usize cap;
 
-void freeInstruction(Instruction *inst);
+  bool container;
+  // only with a container.
+  BytecodeHeader header;
+  const char *pool;
+  char *own_pool; // the pool, when it was read from a file
+
+  usize decoded; // instructions decoded so far
+  usize offset;  // of the next instruction from the start
+  char error[128];
+} Decoder;
+
+// start decoding <in>, or the <len> bytes at <bytes>, which must outlive the
+// decoder. They read the header of a container. Return false on error.
+bool openDecoder(Decoder *d, FILE *in);
+bool openDecoderMemory(Decoder *d, const void *bytes, usize len);
+// free what the decoder allocated. <in> is left open.
+void closeDecoder(Decoder *d);
+
+// decode the next instruction into <inst>. Its strings are only valid till
+// the next call: copy them to keep them.
+DecodeStatus decodeInstruction(Decoder *d, Instruction *inst);
+// where every instruction of some bytecode in memory starts.
+typedef struct {
+  uint32_t *offsets; // from the start of the bytes
+  usize len;
+  // set when the bytes aren't valid bytecode.
+  usize error_offset;
+  char error[128];
+} BytecodeIndex;
+
+// check the instruction code and the operands of every instruction in the
+// <len> bytes at <bytes>, in either format, and find where each one starts,
+// in one pass. Returns false if they aren't valid bytecode. The index must be
+// freed either way.
+bool indexBytecode(const void *bytes, usize len, BytecodeIndex *index);
+void freeBytecodeIndex(BytecodeIndex *index);
+
+// how many bytes the instruction takes in bytecode.
+usize instructionSize(const Instruction *inst);
+
+// free whatever the instruction owns, but not the instruction itself.
+void releaseInstruction(Instruction *inst);
 extern const char *inames[];
+// print how many there are of each instruction type in <count>, which is
+// indexed by type, the most common first. Types with none are left out.
+void printInstructionCounts(const usize count[I_WRITE + 1]);
+
+// where the body of a procedure is. Code after `end` continues past it, since
+// the body is only run when called.
+typedef struct {
+  usize start; // first instruction of the body
+  usize end;   // instruction after `ret`
+} Proc;
+
+// a running `loop` instruction.
+typedef struct {
+  i32 index;
+  i32 count;
+  usize start; // first instruction of the body
+} Loop;
+
+// a whole program, loaded in memory. Loops and calls need to jump, so the VM
+// can't just execute instructions as they're read.
+typedef struct {
+  Instruction *code;
+  usize len;
+  Proc *procs; // indexed by procedure id
+  usize procs_len;
+} Program;
+
+// decode every instruction from <in>, or from the <len> bytes at <bytes>.
+// The program owns copies of the strings. Regular files are mapped and
+// decoded from memory.
+Program loadProgram(FILE *in);
+Program loadProgramMemory(const void *bytes, usize len);
+// decode what's left in <d>. Dies if it isn't valid bytecode.
+Program decodeProgram(Decoder *d);
+// find the procedures again, after instructions were added or removed.
+void resolveProcs(Program *p);
+// find the instruction right after the `endloop` that closes the loop whose
+// body starts at <pc>.
+usize skipLoop(const Program *p, usize pc);
+void freeProgram(Program *p);
 
 #endif // !__INSTRUCTION_H__
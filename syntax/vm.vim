@@ -2,7 +2,7 @@ if exists("b:current_syntax")
   finish
 endif
 
-syn keyword vmKW out in push pair swap gc assert_allocated print pop halt die
+syn keyword vmKW out in push pair swap gc assert_allocated print pop halt die call in_line in_chunk push_str vec vec_get vec_len dup over rot head tail
 syn region vmString start=+"+ end=+"+
 syn match vmConstant "\<\d\+\>"
 syn match vmConstant "\<0x\x+\>"
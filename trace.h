@@ -0,0 +1,36 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+// What `gc --trace <file>` writes and `tracedump` reads: a header followed by
+// the last events the VM recorded, oldest first. Everything is in the
+// machine's byte order, the trace is meant to be read where it was taken.
+
+#define TRACE_MAGIC "GCVT"
+#define TRACE_VERSION 1
+// events kept by the VM, older ones are overwritten. A power of two.
+#define TRACE_EVENTS (1 << 16)
+
+typedef enum {
+  TRACE_OP,       // about to run the instruction
+  TRACE_GC_BEGIN, // the instruction needs a collection
+  TRACE_GC_END,
+} TraceKind;
+
+typedef struct {
+  uint32_t pc;      // index of the instruction
+  uint32_t objects; // objects alive
+  uint16_t depth;   // values on the stack
+  uint8_t kind;     // TraceKind
+  uint8_t op;       // IType of the instruction
+} TraceEvent;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  // events recorded in total. The file has the last min(total, TRACE_EVENTS).
+  uint64_t total;
+} TraceHeader;
+
+#endif // !__TRACE_H__
@@ -0,0 +1,115 @@
+// tracedump: print a trace written by `gc --trace`, and what happened in it.
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  usize count[I_WRITE + 1];
+  usize collections;
+  usize collected; // objects freed by them
+  usize max_objects;
+  usize max_depth;
+  // the collection that is running, see TRACE_GC_BEGIN.
+  usize gc_before;
+} Summary;
+
+static void printEvent(uint64_t seq, const TraceEvent *e) {
+  const char *op = e->op <= I_WRITE ? inames[e->op] : "?";
+  switch (e->kind) {
+  case TRACE_OP:
+    printf("%10lu  %6u  %-16s  depth %3u  objects %u\n", seq, e->pc, op,
+           e->depth, e->objects);
+    break;
+  case TRACE_GC_BEGIN:
+  case TRACE_GC_END:
+    printf("%10lu  %6u  %-16s  objects %u, for %s\n", seq, e->pc,
+           e->kind == TRACE_GC_BEGIN ? "gc begin" : "gc end", e->objects, op);
+    break;
+  default:
+    printf("%10lu  unknown event %u\n", seq, e->kind);
+  }
+}
+
+static void summarize(Summary *s, const TraceEvent *e) {
+  if (e->objects > s->max_objects)
+    s->max_objects = e->objects;
+  if (e->depth > s->max_depth)
+    s->max_depth = e->depth;
+
+  if (e->kind == TRACE_OP && e->op <= I_WRITE) {
+    s->count[e->op]++;
+  } else if (e->kind == TRACE_GC_BEGIN) {
+    s->gc_before = e->objects;
+  } else if (e->kind == TRACE_GC_END) {
+    s->collections++;
+    if (s->gc_before > e->objects)
+      s->collected += s->gc_before - e->objects;
+  }
+}
+
+static void printSummary(const TraceHeader *header, usize events,
+                         const Summary *s) {
+  printf("%lu events recorded, the last %lu kept\n", header->total, events);
+  // everything else is only about the events that were kept.
+  printf("%lu collections freed %lu objects\n", s->collections, s->collected);
+  printf("at most %lu objects alive and %lu values on the stack\n",
+         s->max_objects, s->max_depth);
+
+  printInstructionCounts(s->count);
+}
+
+int main(int argc, const char *argv[]) {
+  bool events = true;
+  const char *fname = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0) {
+      events = false;
+    } else if (fname == NULL && argv[i][0] != '-') {
+      fname = argv[i];
+    } else {
+      fname = NULL;
+      break;
+    }
+  }
+  if (fname == NULL) {
+    fprintf(stderr, "Usage: %s [-s] <trace>\n", *argv);
+    fprintf(stderr, "  -s  only print the summary\n");
+    return 1;
+  }
+
+  FILE *in = fopen(fname, "rb");
+  if (in == NULL)
+    die("Couldn't open `%s`: %s", fname, strerror(errno));
+
+  TraceHeader header;
+  if (fread(&header, sizeof(header), 1, in) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+    die("`%s` is not a trace", fname);
+  if (header.version != TRACE_VERSION)
+    die("`%s` is a trace of version %u, expected %d", fname, header.version,
+        TRACE_VERSION);
+
+  // the file only has the last events, number them from the first one kept.
+  uint64_t kept = header.total < TRACE_EVENTS ? header.total : TRACE_EVENTS;
+  uint64_t seq = header.total - kept;
+  Summary summary = {0};
+  TraceEvent e;
+  usize read = 0;
+  while (fread(&e, sizeof(e), 1, in) == 1) {
+    if (events)
+      printEvent(seq + read, &e);
+    summarize(&summary, &e);
+    read++;
+  }
+  fclose(in);
+
+  if (events)
+    putchar('\n');
+  printSummary(&header, read, &summary);
+  return 0;
+}
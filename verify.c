@@ -0,0 +1,242 @@
+#include "verify.h"
+#include "common.h"
+#include "instruction.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef int64_t i64;
+
+// anything over this is surely a mistake, and keeps the math from overflowing.
+#define EFFECT_MAX ((i64)1 << 40)
+
+// what running a piece of code does to the VM.
+typedef struct {
+  i64 need;  // values that must be on the stack before
+  i64 delta; // how much the stack grows
+  i64 peak;  // highest the stack gets, from where it started
+  i64 loops; // loops running at once
+  i64 calls; // calls running at once
+  bool halts;
+} Effect;
+
+typedef enum { BLOCK_TOP, BLOCK_LOOP, BLOCK_PROC } Block;
+typedef enum { PROC_UNSEEN, PROC_VISITING, PROC_DONE } ProcState;
+
+typedef struct {
+  const Program *p;
+  VerifyInfo *info;
+  Effect *procs;
+  ProcState *proc_states;
+} Verifier;
+
+// values that must be on the stack & how it changes, for every instruction
+// with a fixed effect.
+static const struct {
+  i64 need;
+  i64 delta;
+} effects[] = {
+    [I_PRINT] = {1, 0},      [I_READ_I32] = {0, 1},  [I_PSH_I32] = {0, 1},
+    [I_PAIR] = {2, -1},      [I_SWP] = {2, 0},       [I_POP] = {1, -1},
+    [I_HALT] = {0, 0},       [I_DIE] = {0, 0},       [I_GC] = {0, 0},
+    [I_ASSERT] = {0, 0},     [I_LOOP_IDX] = {0, 1},  [I_READ_LINE] = {0, 1},
+    [I_READ_CHUNK] = {0, 1}, [I_PSH_STR] = {0, 1},   [I_VEC_GET] = {2, 0},
+    [I_VEC_LEN] = {1, 1},    [I_DUP] = {1, 1},       [I_OVER] = {2, 1},
+    [I_ROT] = {3, 0},        [I_HEAD] = {1, 0},      [I_TAIL] = {1, 0},
+    [I_HEAP] = {0, 0},       [I_FREE] = {1, -1},     [I_WRITE] = {0, 0},
+};
+
+static bool __attribute__((format(printf, 3, 4)))
+fail(Verifier *v, usize pc, const char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  v->info->error_pc = pc;
+  vsnprintf(v->info->error, sizeof(v->info->error), fmt, va);
+  va_end(va);
+  return false;
+}
+
+static inline i64 max(i64 a, i64 b) { return a > b ? a : b; }
+
+// <a> followed by <b>.
+static Effect seq(Effect a, Effect b) {
+  if (a.halts)
+    return a;
+  return (Effect){
+      .need = max(a.need, b.need - a.delta),
+      .delta = a.delta + b.delta,
+      .peak = max(a.peak, a.delta + b.peak),
+      .loops = max(a.loops, b.loops),
+      .calls = max(a.calls, b.calls),
+      .halts = b.halts,
+  };
+}
+
+// <body> run <n> times in a loop.
+static Effect repeat(Effect body, i64 n) {
+  if (n == 0)
+    return (Effect){0};
+  body.loops++;
+  if (body.halts)
+    return body;
+
+  // the worst iteration is either the first or the last one.
+  i64 last = (n - 1) * body.delta;
+  return (Effect){
+      .need = max(body.need, body.need - last),
+      .delta = n * body.delta,
+      .peak = max(body.peak, last + body.peak),
+      .loops = body.loops,
+      .calls = body.calls,
+      .halts = false,
+  };
+}
+
+static bool block(Verifier *v, usize *pc, Block kind, i64 loops, Effect *e);
+
+static bool proc_effect(Verifier *v, usize pc, i32 id, Effect *e) {
+  const Program *p = v->p;
+  if (id < 0 || (usize)id >= p->procs_len || p->procs[id].end == 0)
+    return fail(v, pc, "call: procedure %d is not defined", id);
+
+  switch (v->proc_states[id]) {
+  case PROC_VISITING:
+    // there's no way to stop, it'd overflow the call stack.
+    return fail(v, pc, "call: procedure %d calls itself", id);
+  case PROC_DONE:
+    *e = v->procs[id];
+    return true;
+  case PROC_UNSEEN:
+    break;
+  }
+
+  v->proc_states[id] = PROC_VISITING;
+  usize body = p->procs[id].start;
+  if (!block(v, &body, BLOCK_PROC, 0, &v->procs[id]))
+    return false;
+  v->procs[id].calls++;
+  v->proc_states[id] = PROC_DONE;
+  *e = v->procs[id];
+  return true;
+}
+
+// verify from *pc till the end of the block: `endloop` for loops, `ret` for
+// procedures and the end of the program for the top level. <loops> is how many
+// loops of the same procedure are around it, which `index` can refer to.
+static bool block(Verifier *v, usize *pc, Block kind, i64 loops, Effect *e) {
+  const Program *p = v->p;
+  *e = (Effect){0};
+
+  while (*pc < p->len) {
+    usize at = (*pc)++;
+    const Instruction *i = &p->code[at];
+    Effect step = {0};
+
+    switch (i->type) {
+    case I_ENDLOOP:
+      if (kind != BLOCK_LOOP)
+        return fail(v, at, "endloop outside of a loop");
+      return true;
+    case I_RET:
+      if (kind != BLOCK_PROC)
+        return fail(v, at, "ret outside of a procedure");
+      return true;
+    case I_LOOP: {
+      if (i->loop.count < 0)
+        return fail(v, at, "loop: negative count %d", i->loop.count);
+      Effect body;
+      if (!block(v, pc, BLOCK_LOOP, loops + 1, &body))
+        return false;
+      i64 n = i->loop.count;
+      if (n > 0 &&
+          (body.delta > EFFECT_MAX / n || body.delta < -EFFECT_MAX / n))
+        return fail(v, at, "loop: the stack grows without bounds");
+      step = repeat(body, n);
+    } break;
+    case I_PROC:
+      if (kind != BLOCK_TOP)
+        return fail(v, at, "proc: procedures must be at the top level");
+      // not run here, it's verified on its own.
+      *pc = p->procs[i->proc.id].end;
+      break;
+    case I_CALL:
+      if (!proc_effect(v, at, i->proc.id, &step))
+        return false;
+      break;
+    case I_LOOP_IDX:
+      if (i->index.depth < 0 || i->index.depth >= loops)
+        return fail(v, at, "index: no loop %d levels out", i->index.depth);
+      step.delta = 1;
+      break;
+    case I_VEC:
+      if (i->vec.len < 0)
+        return fail(v, at, "vec: negative length %d", i->vec.len);
+      step.need = i->vec.len;
+      step.delta = 1 - i->vec.len;
+      break;
+    case I_HEAP:
+      if (at != 0)
+        return fail(v, at, "heap: must be the first instruction");
+      if (i->heap.objects < 0)
+        return fail(v, at, "heap: negative size %d", i->heap.objects);
+      break;
+    case I_READ_CHUNK:
+      if (i->chunk.size <= 0)
+        return fail(v, at, "in_chunk: size must be positive, got %d",
+                    i->chunk.size);
+      step.delta = 1;
+      break;
+    default:
+      step.need = effects[i->type].need;
+      step.delta = effects[i->type].delta;
+      step.halts = i->type == I_HALT || i->type == I_DIE;
+      break;
+    }
+    if (step.delta > step.peak)
+      step.peak = step.delta;
+
+    *e = seq(*e, step);
+    // the top level starts with an empty stack, so we know exactly where.
+    if (kind == BLOCK_TOP && e->need > 0)
+      return fail(v, at, "%s: stack underflow", inames[i->type]);
+  }
+
+  if (kind == BLOCK_LOOP)
+    return fail(v, *pc, "loop is not closed with endloop");
+  if (kind == BLOCK_PROC)
+    return fail(v, *pc, "procedure is not closed with ret");
+  return true;
+}
+
+bool verifyProgram(const Program *p, VerifyInfo *info) {
+  memset(info, 0, sizeof(*info));
+  Verifier v = {
+      .p = p,
+      .info = info,
+      .procs = calloc(p->procs_len, sizeof(Effect)),
+      .proc_states = calloc(p->procs_len, sizeof(ProcState)),
+  };
+
+  usize pc = 0;
+  Effect e;
+  bool ok = block(&v, &pc, BLOCK_TOP, 0, &e);
+
+  // procedures that are never called should make sense too.
+  for (usize id = 0; ok && id < p->procs_len; id++) {
+    Effect unused;
+    if (p->procs[id].end != 0)
+      ok = proc_effect(&v, p->procs[id].start - 1, id, &unused);
+  }
+
+  if (ok) {
+    info->max_depth = e.peak;
+    info->max_loops = e.loops;
+    info->max_calls = e.calls;
+  }
+
+  free(v.procs);
+  free(v.proc_states);
+  return ok;
+}
@@ -0,0 +1,26 @@
+#ifndef __VERIFY_H__
+#define __VERIFY_H__
+
+#include "common.h"
+#include "instruction.h"
+#include <stdbool.h>
+
+// what a program needs from the VM to run, found without running it.
+typedef struct {
+  usize max_depth; // values on the stack at once
+  usize max_loops; // loops running at once
+  usize max_calls; // procedure calls running at once
+
+  // set when the program is rejected.
+  usize error_pc;
+  char error[128];
+} VerifyInfo;
+
+// check that the program never pops from an empty stack, that every block is
+// closed and that every operand makes sense, and find its limits.
+// Programs have no branches, so every loop and call can be summarized by its
+// effect on the stack. A program that passes can run without any of these
+// checks at runtime.
+bool verifyProgram(const Program *p, VerifyInfo *info);
+
+#endif // !__VERIFY_H__
@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include "vm.h"
+#include "common.h"
+#include "instruction.h"
+#include "verify.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+VM *newVM() {
+  VM *vm = malloc(sizeof(*vm));
+  memset(vm, 0, sizeof(*vm));
+  vm->max_objects = INITIAL_GC_THRESHOLD;
+  vm->min_objects = INITIAL_GC_THRESHOLD;
+  vm->print_cap = 64;
+  vm->print_stack = calloc(vm->print_cap, sizeof(*vm->print_stack));
+  vm->read_cap = 64;
+  vm->read_buf = malloc(vm->read_cap);
+  vm->gray_cap = 64;
+  vm->gray = calloc(vm->gray_cap, sizeof(*vm->gray));
+  return vm;
+}
+
+// allocate room for <objects> objects at once, and don't collect till there
+// are twice as many. Only numbers and pairs come from here, since strings and
+// vectors carry their contents in the same allocation.
+void reserveHeap(VM *vm, usize objects) {
+  assert(vm->pool == NULL, "the heap is already reserved");
+  if (objects > HEAP_RESERVE_MAX)
+    objects = HEAP_RESERVE_MAX;
+  if (objects == 0)
+    return;
+
+  vm->pool = calloc(objects, sizeof(*vm->pool));
+  vm->pool_len = objects;
+  for (usize i = objects; i > 0; i--) {
+    vm->pool[i - 1].next = vm->free_objects;
+    vm->free_objects = &vm->pool[i - 1];
+  }
+
+  if ((i32)objects * 2 > vm->min_objects)
+    vm->min_objects = objects * 2;
+  if (vm->max_objects < vm->min_objects)
+    vm->max_objects = vm->min_objects;
+}
+
+static inline bool inPool(const VM *vm, const Object *obj) {
+  return obj >= vm->pool && obj < vm->pool + vm->pool_len;
+}
+
+// allocate a byte string in a single allocation, without collecting.
+Object *allocBytes(VM *vm, const void *bytes, usize len) {
+  Object *object = linkObject(vm, malloc(sizeof(Object) + len), OBJ_BYTES);
+  object->bytes = (u8 *)(object + 1);
+  object->len = len;
+  memcpy(object->bytes, bytes, len);
+  return object;
+}
+
+// allocate a vector of <len> items in a single allocation, without
+// collecting. The items are left for the caller to fill.
+Object *allocVec(VM *vm, usize len) {
+  Object *object =
+      linkObject(vm, malloc(sizeof(Object) + len * sizeof(Object *)), OBJ_VEC);
+  object->items = (Object **)(object + 1);
+  object->items_len = len;
+  return object;
+}
+
+// mark the object and leave it for `markAll` to scan.
+static inline void mark(VM *vm, usize *len, Object *obj) {
+  if (obj->is_marked)
+    return;
+  obj->is_marked = true;
+  if (obj->type != OBJ_PAIR && obj->type != OBJ_VEC)
+    return;
+  if (*len == vm->gray_cap) {
+    vm->gray_cap *= 2;
+    vm->gray = reallocarray(vm->gray, vm->gray_cap, sizeof(*vm->gray));
+  }
+  vm->gray[(*len)++] = obj;
+}
+
+// mark all reachable objects. Uses a worklist instead of recursion so that
+// long lists and big vectors don't blow the C stack.
+void markAll(VM *vm) {
+  usize len = 0;
+  for (usize i = 0; i < (usize)vm->stack_size; i++) {
+    mark(vm, &len, vm->stack[i]);
+  }
+
+  while (len > 0) {
+    Object *obj = vm->gray[--len];
+    if (obj->type == OBJ_PAIR) {
+      mark(vm, &len, obj->head);
+      mark(vm, &len, obj->tail);
+    } else {
+      for (usize i = 0; i < obj->items_len; i++)
+        mark(vm, &len, obj->items[i]);
+    }
+  }
+}
+
+// take the object out of the list of objects and give its memory back.
+static void releaseObject(VM *vm, Object *obj) {
+  if (obj->prev)
+    obj->prev->next = obj->next;
+  else
+    vm->first = obj->next;
+  if (obj->next)
+    obj->next->prev = obj->prev;
+  vm->num_objects--;
+
+  if (inPool(vm, obj)) {
+    obj->next = vm->free_objects;
+    vm->free_objects = obj;
+  } else {
+    free(obj);
+  }
+}
+
+void sweep(VM *vm) {
+  Object *next;
+  for (Object *object = vm->first; object; object = next) {
+    next = object->next;
+    if (!object->is_marked) {
+      /* This object wasn't reached, so remove it from the list and free it. */
+      releaseObject(vm, object);
+    } else {
+      /* This object was reached, so unmark it (for the next GC). */
+      object->is_marked = 0;
+    }
+  }
+}
+
+// free <obj> and everything under it without tracing. The assembler only
+// emits `free` when nothing else refers to any of them.
+void freeTree(VM *vm, Object *obj) {
+  usize len = 0;
+  vm->gray[len++] = obj;
+  while (len > 0) {
+    obj = vm->gray[--len];
+    usize children = obj->type == OBJ_PAIR  ? 2
+                     : obj->type == OBJ_VEC ? obj->items_len
+                                            : 0;
+    while (len + children > vm->gray_cap) {
+      vm->gray_cap *= 2;
+      vm->gray = reallocarray(vm->gray, vm->gray_cap, sizeof(*vm->gray));
+    }
+    if (obj->type == OBJ_PAIR) {
+      vm->gray[len++] = obj->head;
+      vm->gray[len++] = obj->tail;
+    } else if (obj->type == OBJ_VEC) {
+      memcpy(&vm->gray[len], obj->items, children * sizeof(*obj->items));
+      len += children;
+    }
+    releaseObject(vm, obj);
+  }
+}
+
+void gc(VM *vm) {
+  markAll(vm);
+  sweep(vm);
+  vm->max_objects = vm->num_objects * 2;
+  // otherwise an empty heap would collect on every allocation.
+  if (vm->max_objects < vm->min_objects)
+    vm->max_objects = vm->min_objects;
+}
+
+static void writeOutput(const u8 *buf, usize len) {
+  while (len > 0) {
+    ssize_t written = write(STDOUT_FILENO, buf, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      die("while writing output: %s", strerror(errno));
+    }
+    buf += written;
+    len -= written;
+  }
+}
+
+void flushOutput(VM *vm) {
+  usize len = vm->out.len;
+  // don't try to flush again when dying if writing fails.
+  vm->out.len = 0;
+  writeOutput(vm->out.buf, len);
+}
+
+static inline void outByte(VM *vm, u8 b) {
+  if (vm->out.len == OUTPUT_BUFFER_SIZE)
+    flushOutput(vm);
+  vm->out.buf[vm->out.len++] = b;
+}
+
+void outBytes(VM *vm, const u8 *bytes, usize len) {
+  if (vm->out.len + len > OUTPUT_BUFFER_SIZE) {
+    flushOutput(vm);
+    // too big to be worth copying.
+    if (len > OUTPUT_BUFFER_SIZE) {
+      writeOutput(bytes, len);
+      return;
+    }
+  }
+  memcpy(&vm->out.buf[vm->out.len], bytes, len);
+  vm->out.len += len;
+}
+
+// output the bytes of every leaf of <obj>, in order.
+void objPrint(VM *vm, const Object *obj) {
+  usize len = 0;
+  bool newline = false;
+  vm->print_stack[len++] = obj;
+
+  while (len > 0) {
+    obj = vm->print_stack[--len];
+    switch (obj->type) {
+    case OBJ_INT:
+      outByte(vm, obj->value);
+      newline |= (u8)obj->value == '\n';
+      break;
+    case OBJ_BYTES:
+      outBytes(vm, obj->bytes, obj->len);
+      newline |= memchr(obj->bytes, '\n', obj->len) != NULL;
+      break;
+    case OBJ_PAIR:
+      if (len + 2 > vm->print_cap) {
+        vm->print_cap *= 2;
+        vm->print_stack = reallocarray(vm->print_stack, vm->print_cap,
+                                       sizeof(*vm->print_stack));
+      }
+      // head goes out first.
+      vm->print_stack[len++] = obj->tail;
+      vm->print_stack[len++] = obj->head;
+      break;
+    case OBJ_VEC:
+      while (len + obj->items_len > vm->print_cap) {
+        vm->print_cap *= 2;
+        vm->print_stack = reallocarray(vm->print_stack, vm->print_cap,
+                                       sizeof(*vm->print_stack));
+      }
+      for (usize i = obj->items_len; i > 0; i--)
+        vm->print_stack[len++] = obj->items[i - 1];
+      break;
+    }
+  }
+
+  if (newline && vm->out.line_buffered)
+    flushOutput(vm);
+}
+
+// refill the input buffer. Returns false at the end of the input.
+static bool fillInput(VM *vm) {
+  if (vm->in.eof)
+    return false;
+  // whatever was written may be a prompt for this input.
+  flushOutput(vm);
+
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, vm->in.buf, INPUT_BUFFER_SIZE)) < 0) {
+    if (errno != EINTR)
+      die("while reading input: %s", strerror(errno));
+  }
+  vm->in.pos = 0;
+  vm->in.len = n;
+  vm->in.eof = n == 0;
+  return n > 0;
+}
+
+// read a single byte, or EOF.
+i32 readByte(VM *vm) {
+  if (vm->in.pos == vm->in.len && !fillInput(vm))
+    return EOF;
+  return vm->in.buf[vm->in.pos++];
+}
+
+// read up to <max> bytes into `vm->read_buf`, stopping after <delim> unless
+// it's EOF. Returns the amount of bytes read.
+usize readBytes(VM *vm, usize max, int delim) {
+  usize len = 0;
+  while (len < max) {
+    if (vm->in.pos == vm->in.len && !fillInput(vm))
+      break;
+
+    const u8 *start = &vm->in.buf[vm->in.pos];
+    usize n = vm->in.len - vm->in.pos;
+    if (n > max - len)
+      n = max - len;
+    const u8 *end = delim == EOF ? NULL : memchr(start, delim, n);
+    if (end != NULL)
+      n = end - start + 1;
+
+    if (len + n > vm->read_cap) {
+      while (len + n > vm->read_cap)
+        vm->read_cap *= 2;
+      vm->read_buf = realloc(vm->read_buf, vm->read_cap);
+    }
+    memcpy(&vm->read_buf[len], start, n);
+    len += n;
+    vm->in.pos += n;
+
+    if (end != NULL)
+      break;
+  }
+  return len;
+}
+
+// build the bytes as a list of pairs, in the same shape that `print` does:
+// ((b0, b1), b2)... An empty list is EOF, like `in`.
+// Doesn't collect, see `allocObject`.
+Object *bytesList(VM *vm, const u8 *bytes, usize len) {
+  Object *list = allocObject(vm, OBJ_INT);
+  list->value = len == 0 ? EOF : bytes[0];
+  for (usize i = 1; i < len; i++) {
+    Object *b = allocObject(vm, OBJ_INT);
+    b->value = bytes[i];
+    Object *pair = allocObject(vm, OBJ_PAIR);
+    pair->head = list;
+    pair->tail = b;
+    list = pair;
+  }
+  return list;
+}
+
+void freeVM(VM *vm) {
+  flushOutput(vm);
+  vm->stack_size = 0;
+  gc(vm);
+  free(vm->print_stack);
+  free(vm->read_buf);
+  free(vm->gray);
+  free(vm->pool);
+  if (vm->trace != NULL) {
+    close(vm->trace->fd);
+    free(vm->trace);
+  }
+  free(vm);
+}
+
+// The instructions that aren't just a call to one of the above, for programs
+// compiled by `aotc`. They work on `vm->stack` directly, the interpreter keeps
+// the top of the stack apart instead, see `_run`.
+
+void opPrint(VM *vm) { objPrint(vm, vm->stack[vm->stack_size - 1]); }
+
+void opWrite(VM *vm, const char *bytes, usize len) {
+  outBytes(vm, (const u8 *)bytes, len);
+  if (vm->out.line_buffered && memchr(bytes, '\n', len))
+    flushOutput(vm);
+}
+
+void opReadI32(VM *vm) { pushInt(vm, readByte(vm)); }
+
+static void pushRead(VM *vm, usize len) {
+  // collect at most once for the whole list.
+  if (vm->num_objects + bytesListSize(len) > (usize)vm->max_objects)
+    gc(vm);
+  push(vm, bytesList(vm, vm->read_buf, len));
+}
+
+void opReadLine(VM *vm) { pushRead(vm, readBytes(vm, SIZE_MAX, '\n')); }
+
+void opReadChunk(VM *vm, i32 size) {
+  pushRead(vm, readBytes(vm, size, EOF));
+}
+
+void opPushStr(VM *vm, const char *bytes, usize len) {
+  if (needsGC(vm))
+    gc(vm);
+  push(vm, allocBytes(vm, bytes, len));
+}
+
+void opVec(VM *vm, i32 n) {
+  if (needsGC(vm))
+    gc(vm);
+  Object *o = allocVec(vm, n);
+  vm->stack_size -= n;
+  memcpy(o->items, &vm->stack[vm->stack_size], n * sizeof(*o->items));
+  push(vm, o);
+}
+
+void opVecGet(VM *vm) {
+  const Object *index = pop(vm);
+  const Object *v = vm->stack[vm->stack_size - 1];
+  assert(index->type == OBJ_INT, "vec_get: index must be a number");
+  assert(v->type == OBJ_VEC, "vec_get: not a vector");
+  assert(index->value >= 0 && (usize)index->value < v->items_len,
+         "vec_get: index %d out of bounds for length %lu", index->value,
+         v->items_len);
+  push(vm, v->items[index->value]);
+}
+
+void opVecLen(VM *vm) {
+  const Object *v = vm->stack[vm->stack_size - 1];
+  assert(v->type == OBJ_VEC, "vec_len: not a vector");
+  pushInt(vm, v->items_len);
+}
+
+void opDup(VM *vm) { push(vm, vm->stack[vm->stack_size - 1]); }
+
+void opOver(VM *vm) { push(vm, vm->stack[vm->stack_size - 2]); }
+
+void opSwap(VM *vm) {
+  Object **top = &vm->stack[vm->stack_size - 1];
+  Object *o = top[0];
+  top[0] = top[-1];
+  top[-1] = o;
+}
+
+void opRot(VM *vm) {
+  // a b c -> b c a
+  Object **top = &vm->stack[vm->stack_size - 1];
+  Object *a = top[-2];
+  top[-2] = top[-1];
+  top[-1] = top[0];
+  top[0] = a;
+}
+
+void opHead(VM *vm) {
+  Object **top = &vm->stack[vm->stack_size - 1];
+  assert((*top)->type == OBJ_PAIR, "head: not a pair");
+  *top = (*top)->head;
+}
+
+void opTail(VM *vm) {
+  Object **top = &vm->stack[vm->stack_size - 1];
+  assert((*top)->type == OBJ_PAIR, "tail: not a pair");
+  *top = (*top)->tail;
+}
+
+void opFree(VM *vm) { freeTree(vm, pop(vm)); }
+
+void opAssert(VM *vm, i32 expected, const char *msg) {
+  assert(vm->num_objects == expected, "%s", msg);
+}
+
+// the VM that is running, so that its output and trace aren't lost if it dies.
+static VM *running_vm = NULL;
+
+static void flushOnDie(void) {
+  if (running_vm != NULL) {
+    flushOutput(running_vm);
+    if (running_vm->trace != NULL)
+      dumpTrace(running_vm);
+  }
+}
+
+// only uses `write`, so it's fine to call from a signal handler.
+static void writeAll(int fd, const void *buf, usize len) {
+  const u8 *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return;
+    p += n;
+    len -= n;
+  }
+}
+
+void dumpTrace(const VM *vm) {
+  const Trace *t = vm->trace;
+  TraceHeader header = {.magic = TRACE_MAGIC,
+                        .version = TRACE_VERSION,
+                        .total = t->total};
+  lseek(t->fd, 0, SEEK_SET);
+  writeAll(t->fd, &header, sizeof(header));
+  if (t->total <= TRACE_EVENTS) {
+    writeAll(t->fd, t->events, t->total * sizeof(*t->events));
+  } else {
+    // the oldest event is the one that would be overwritten next.
+    usize next = t->total % TRACE_EVENTS;
+    writeAll(t->fd, &t->events[next],
+             (TRACE_EVENTS - next) * sizeof(*t->events));
+    writeAll(t->fd, t->events, next * sizeof(*t->events));
+  }
+}
+
+static void dumpOnSignal(int sig) {
+  if (running_vm != NULL && running_vm->trace != NULL)
+    dumpTrace(running_vm);
+  // the handler was reset, so this does what the signal would have done.
+  raise(sig);
+}
+
+void startTrace(VM *vm, const char *path) {
+  // opened now so that dumping doesn't need to allocate or fail.
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    die("Couldn't open `%s`: %s", path, strerror(errno));
+  vm->trace = malloc(sizeof(*vm->trace));
+  vm->trace->total = 0;
+  vm->trace->fd = fd;
+
+  struct sigaction sa = {.sa_handler = dumpOnSignal,
+                         .sa_flags = SA_RESETHAND};
+  sigemptyset(&sa.sa_mask);
+  int signals[] = {SIGINT, SIGTERM, SIGHUP, SIGSEGV, SIGBUS, SIGFPE, SIGABRT};
+  for (usize k = 0; k < sizeof(signals) / sizeof(*signals); k++)
+    sigaction(signals[k], &sa, NULL);
+}
+
+void setRunningVM(VM *vm) {
+  running_vm = vm;
+  atdie(flushOnDie);
+}
+
+void checkProgram(const Program *p) {
+  VerifyInfo info;
+  if (!verifyProgram(p, &info))
+    die("invalid program at instruction %lu: %s", info.error_pc, info.error);
+  if (info.max_depth > STACK_MAX)
+    die("program needs a stack of %lu values, the maximum is %d",
+        info.max_depth, STACK_MAX);
+  if (info.max_loops > LOOP_MAX)
+    die("program nests %lu loops, the maximum is %d", info.max_loops,
+        LOOP_MAX);
+  if (info.max_calls > CALL_MAX)
+    die("program nests %lu calls, the maximum is %d", info.max_calls,
+        CALL_MAX);
+}
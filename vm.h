@@ -0,0 +1,251 @@
+#ifndef __VM_H__
+#define __VM_H__
+
+#include "common.h"
+#include "instruction.h"
+#include "trace.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef enum { OBJ_INT, OBJ_PAIR, OBJ_BYTES, OBJ_VEC } ObjType;
+
+typedef struct _object {
+  ObjType type;
+  bool is_marked; // useful for GC
+  // IMO not needing this.
+  // GC can collect from its stack if it marks the pointers
+  // correctly (using NULLs when popping).
+  // with this, we're maintaining double stack. This, although
+  // not really a problem (just 8 bytes) is not necessary.
+  struct _object *next;
+  // so `free` can take an object out of the list without searching for it.
+  struct _object *prev;
+
+  union {
+    /* OBJ_INT */
+    i32 value;
+
+    /* OBJ_PAIR */
+    struct {
+      struct _object *head;
+      struct _object *tail;
+    };
+
+    /* OBJ_BYTES */
+    struct {
+      u8 *bytes; // allocated right after the object
+      usize len;
+    };
+
+    /* OBJ_VEC */
+    struct {
+      struct _object **items; // allocated right after the object
+      usize items_len;
+    };
+  };
+} Object;
+
+// VM
+#define STACK_MAX 256
+#define LOOP_MAX 64
+#define CALL_MAX 256
+#define INITIAL_GC_THRESHOLD 100
+// most objects reserved up front, whatever the program asks for.
+#define HEAP_RESERVE_MAX (1 << 20)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+// what `out` writes to. It's only written to stdout when full, on `halt`,
+// before reading input and when the VM exits.
+typedef struct {
+  u8 buf[OUTPUT_BUFFER_SIZE];
+  usize len;
+  // also flush after writing a newline.
+  bool line_buffered;
+} Output;
+
+// what `in` and friends read from. It's filled with big reads from stdin.
+typedef struct {
+  u8 buf[INPUT_BUFFER_SIZE];
+  usize pos;
+  usize len;
+  bool eof;
+} Input;
+
+// the last TRACE_EVENTS events of a traced VM, see `startTrace`.
+typedef struct {
+  TraceEvent events[TRACE_EVENTS];
+  // events recorded so far, the next one goes in `events[total %
+  // TRACE_EVENTS]`.
+  uint64_t total;
+  int fd;
+} Trace;
+
+typedef struct {
+  Object *stack[STACK_MAX];
+  Object *first;
+  i32 stack_size;
+  i32 num_objects;
+  i32 max_objects;
+  // `gc` never sets `max_objects` lower than this.
+  i32 min_objects;
+  bool has_halted;
+
+  // objects reserved by `reserveHeap`. The unused ones are kept in
+  // `free_objects`, linked through `next`.
+  Object *pool;
+  usize pool_len;
+  Object *free_objects;
+
+  // next instruction to execute.
+  usize pc;
+  Loop loops[LOOP_MAX];
+  i32 loop_depth;
+  // return addresses of the running procedures.
+  usize rets[CALL_MAX];
+  i32 call_depth;
+
+  Output out;
+  // pending objects for `objPrint`, so it doesn't need to recurse.
+  const Object **print_stack;
+  usize print_cap;
+
+  // objects that are marked but whose children aren't, see `markAll`.
+  Object **gray;
+  usize gray_cap;
+
+  Input in;
+  // bytes of the last `in_line`/`in_chunk`.
+  u8 *read_buf;
+  usize read_cap;
+
+  // NULL unless tracing.
+  Trace *trace;
+} VM;
+
+VM *newVM();
+void freeVM(VM *vm);
+void reserveHeap(VM *vm, usize objects);
+
+// record what the VM does from now on, and write it to <path> when it dies,
+// gets a signal, or `dumpTrace` is called.
+void startTrace(VM *vm, const char *path);
+void dumpTrace(const VM *vm);
+
+static inline void traceEvent(Trace *t, TraceKind kind, IType op, usize pc,
+                              i32 depth, i32 objects) {
+  t->events[t->total++ % TRACE_EVENTS] = (TraceEvent){
+      .pc = pc, .objects = objects, .depth = depth, .kind = kind, .op = op};
+}
+
+// C code isn't verified like programs are, so these check the stack.
+static inline void push(VM *vm, Object *value) {
+  if (vm->stack_size >= STACK_MAX)
+    die("Stack overflow");
+  vm->stack[vm->stack_size++] = value;
+}
+
+static inline Object *pop(VM *vm) {
+  if (vm->stack_size <= 0)
+    die("Stack underflow");
+  return vm->stack[--vm->stack_size];
+}
+
+void gc(VM *vm);
+void freeTree(VM *vm, Object *obj);
+
+static inline bool needsGC(const VM *vm) {
+  return vm->num_objects >= vm->max_objects;
+}
+
+static inline Object *linkObject(VM *vm, Object *object, ObjType type) {
+  object->next = NULL;
+  object->prev = NULL;
+  object->type = type;
+  object->is_marked = false;
+
+  // prepend new object
+  object->next = vm->first;
+  if (vm->first)
+    vm->first->prev = object;
+  vm->first = object;
+  vm->num_objects++;
+
+  return object;
+}
+
+// allocate without collecting first. Whoever calls this must have made sure
+// every root is in `vm->stack`, or that there's no need to collect.
+static inline Object *allocObject(VM *vm, ObjType type) {
+  Object *object = vm->free_objects;
+  if (object != NULL)
+    vm->free_objects = object->next;
+  else
+    object = malloc(sizeof(Object));
+  return linkObject(vm, object, type);
+}
+
+Object *allocBytes(VM *vm, const void *bytes, usize len);
+Object *allocVec(VM *vm, usize len);
+
+static inline Object *newObject(VM *vm, ObjType type) {
+  if (needsGC(vm))
+    gc(vm);
+  return allocObject(vm, type);
+}
+
+// Push a single integer value.
+static inline void pushInt(VM *vm, i32 intValue) {
+  Object *object = newObject(vm, OBJ_INT);
+  object->value = intValue;
+  push(vm, object);
+}
+
+/// Pop last two values and put them in a pair.
+static inline Object *pushPair(VM *vm) {
+  Object *obj = newObject(vm, OBJ_PAIR);
+  obj->tail = pop(vm);
+  obj->head = pop(vm);
+
+  push(vm, obj);
+  return obj;
+}
+
+void flushOutput(VM *vm);
+void outBytes(VM *vm, const u8 *bytes, usize len);
+void objPrint(VM *vm, const Object *obj);
+
+i32 readByte(VM *vm);
+usize readBytes(VM *vm, usize max, int delim);
+// objects needed by `bytesList` for <len> bytes.
+static inline usize bytesListSize(usize len) {
+  return len == 0 ? 1 : 2 * len - 1;
+}
+Object *bytesList(VM *vm, const u8 *bytes, usize len);
+
+// instructions for programs compiled by `aotc`. `push`, `pair`, `pop` and `gc`
+// are `pushInt`, `pushPair`, `pop` and `gc`.
+void opPrint(VM *vm);
+void opWrite(VM *vm, const char *bytes, usize len);
+void opReadI32(VM *vm);
+void opReadLine(VM *vm);
+void opReadChunk(VM *vm, i32 size);
+void opPushStr(VM *vm, const char *bytes, usize len);
+void opVec(VM *vm, i32 n);
+void opVecGet(VM *vm);
+void opVecLen(VM *vm);
+void opDup(VM *vm);
+void opOver(VM *vm);
+void opSwap(VM *vm);
+void opRot(VM *vm);
+void opHead(VM *vm);
+void opTail(VM *vm);
+void opFree(VM *vm);
+void opAssert(VM *vm, i32 expected, const char *msg);
+
+// flush the output of <vm> if the program dies while it runs.
+void setRunningVM(VM *vm);
+// die unless the program is valid and fits in the VM's limits.
+void checkProgram(const Program *p);
+
+#endif // !__VM_H__